@@ -0,0 +1,127 @@
+#!/bin/sh
+#
+# Throughput and latency benchmark of proj2
+# Runs proj2 over a matrix of parameters and collects the --report
+# rows of all runs into one CSV file (default bench_results.csv)
+#
+# Usage: ./bench.sh [OUTPUT]
+# The matrix is set by space separated lists in the environment:
+#   MODES (processes threads fibers virtual-time), POLICIES (officer schedulers),
+#   SERVICES (number of service types), BATCH (--batch), N_CUS, N_OFF, T_CUS, T_OFF, F
+#   MAX_OFF (--max-officers, 0 for fixed N_OFF, compare served_per_officer_sec)
+#   PLACEMENTS - none, numa (--numa) or OFFICER_CPUS/CUSTOMER_CPUS, e.g. 0-3/4-7,
+#   compare the cpu_served column (customers served on every CPU)
+#   RUNS - number of repetitions of every combination
+#   CLOSING_RUNS - runs of the autoscaler closing check after the matrix (0 to skip)
+#
+
+PROJ2=${PROJ2:-$(pwd)/proj2}
+OUT=${1:-bench_results.csv}
+
+MODES=${MODES:-"processes threads virtual-time"}
+POLICIES=${POLICIES:-"random longest oldest round-robin weighted"}
+SERVICES=${SERVICES:-"3"}
+BATCH=${BATCH:-"1"}
+N_CUS=${N_CUS:-"100 1000"}
+N_OFF=${N_OFF:-"1 4"}
+MAX_OFF=${MAX_OFF:-"0"}
+T_CUS=${T_CUS:-"0 100"}
+T_OFF=${T_OFF:-"0 10"}
+F=${F:-"100"}
+PLACEMENTS=${PLACEMENTS:-"none"}
+RUNS=${RUNS:-1}
+CLOSING_RUNS=${CLOSING_RUNS:-20}
+
+COMMIT=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+
+if [ ! -x "$PROJ2" ]; then
+    echo "bench.sh: $PROJ2 not found, run make first" >&2
+    exit 1
+fi
+
+# proj2.out of every run goes to a scratch directory
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+rm -f "$OUT"
+failed=0
+
+for mode in $MODES; do
+    case $mode in
+        processes) flag="" ;;
+        threads) flag="--threads" ;;
+        fibers) flag="--fibers" ;;
+        virtual-time) flag="--virtual-time" ;;
+        *) echo "bench.sh: unknown mode $mode" >&2; exit 1 ;;
+    esac
+
+    for policy in $POLICIES; do
+    for services in $SERVICES; do
+    for batch in $BATCH; do
+    for nz in $N_CUS; do
+    for nu in $N_OFF; do
+    for maxoff in $MAX_OFF; do
+    for tz in $T_CUS; do
+    for tu in $T_OFF; do
+    for f in $F; do
+    for place in $PLACEMENTS; do
+        # The autoscaler needs real time and starts from N_OFF
+        if [ "$maxoff" -ne 0 ] && { [ "$mode" = virtual-time ] || [ "$maxoff" -lt "$nu" ]; }; then
+            continue
+        fi
+
+        # The virtual time runs in one thread, there is nothing to place
+        if [ "$place" != none ] && [ "$mode" = virtual-time ]; then
+            continue
+        fi
+        case $place in
+            none) pin="" ;;
+            numa) pin="--numa" ;;
+            */*) pin="--officer-cpus=${place%/*} --customer-cpus=${place#*/}" ;;
+            *) echo "bench.sh: unknown placement $place" >&2; exit 1 ;;
+        esac
+
+        run=1
+        while [ "$run" -le "$RUNS" ]; do
+            if ! (cd "$TMP" && "$PROJ2" $flag --policy="$policy" --services="$services" --batch="$batch" --max-officers="$maxoff" $pin --report=report.csv "$nz" "$nu" "$tz" "$tu" "$f"); then
+                echo "bench.sh: failed: $mode $policy $services $batch $nz $nu $maxoff $tz $tu $f $place" >&2
+                failed=$((failed + 1))
+                run=$((run + 1))
+                continue
+            fi
+
+            if [ ! -f "$OUT" ]; then
+                printf 'commit,run,%s\n' "$(head -n 1 "$TMP/report.csv")" > "$OUT"
+            fi
+            row=$(tail -n 1 "$TMP/report.csv")
+            printf '%s,%s,%s\n' "$COMMIT" "$run" "$row" >> "$OUT"
+            echo "$row"
+            run=$((run + 1))
+        done
+    done
+    done
+    done
+    done
+    done
+    done
+    done
+    done
+    done
+    done
+done
+
+# Officers sent home by the autoscaler just before the closing must leave
+# the closing tokens to the officers at work, a run that hangs is a failure
+run=1
+while [ "$run" -le "$CLOSING_RUNS" ]; do
+    for flag in "" --threads; do
+        if ! (cd "$TMP" && timeout 10 "$PROJ2" $flag --max-officers=6 --scale-depth=1 200 1 5 0 100 > /dev/null); then
+            echo "bench.sh: failed: closing with --max-officers=6 --scale-depth=1 $flag, run $run" >&2
+            failed=$((failed + 1))
+        fi
+    done
+    run=$((run + 1))
+done
+
+echo "Results written to $OUT"
+[ "$failed" -eq 0 ]
@@ -0,0 +1,505 @@
+/**************************/
+/* *  Daniel Sehnoutek  * */
+/* *        IOS2        * */
+/**************************/
+
+/*
+ *  proj2-check - validator of proj2.out
+ *  The file is mapped and parsed in chunks by several threads
+ *  into compact records, one pass over the records then checks
+ *  the order of the lines of every customer and officer
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Errors printed at most, the check goes on counting them
+#define MAX_ERRORS_SHOWN 20
+
+// Most parser threads
+#define MAX_THREADS 256
+
+// Chunks smaller than this are not worth a thread of their own
+#define MIN_CHUNK (1 << 20)
+
+typedef enum {
+    EV_BAD_LINE,
+    EV_CLOSING,
+    EV_SCALING,
+    EV_Z_STARTED,
+    EV_Z_ENTERING,
+    EV_Z_CALLED,
+    EV_Z_GOING_HOME,
+    EV_U_STARTED,
+    EV_U_SERVING,
+    EV_U_SERVICE_FINISHED,
+    EV_U_TAKING_BREAK,
+    EV_U_BREAK_FINISHED,
+    EV_U_GOING_HOME
+} Event;
+
+/*
+ *  Structure: Line
+ *  ---------------
+ *  One parsed line, service is the number of
+ *  entering and serving lines, gap is set if the
+ *  number of the line does not follow the previous one
+ */
+typedef struct {
+    uint32_t id;
+    uint16_t service;
+    uint8_t event;
+    uint8_t gap;
+} Line;
+
+/*
+ *  Structure: Chunk
+ *  ----------------
+ *  Part of the file parsed by one thread, the numbers
+ *  of its first and last lines, 0 if unknown
+ */
+typedef struct {
+    const char *begin;
+    const char *end;
+    Line *lines;
+    size_t count;
+    size_t capacity;
+    uint64_t first;
+    uint64_t last;
+} Chunk;
+
+typedef enum {
+    Z_NONE,
+    Z_STARTED,
+    Z_ENTERED,
+    Z_CALLED,
+    Z_HOME
+} CustomerState;
+
+typedef enum {
+    U_NONE,
+    U_READY,
+    U_SERVING,
+    U_BREAK,
+    U_HOME
+} OfficerState;
+
+/*
+ *  Structure: Customer
+ *  -------------------
+ *  State of a customer and the service it entered for
+ */
+typedef struct {
+    uint8_t state;
+    uint16_t service;
+} Customer;
+
+/*
+ *  Structure: Checker
+ *  ------------------
+ *  State of the customers, officers and services while
+ *  going through the lines in order
+ */
+typedef struct {
+    Customer *customers;
+    size_t num_customers;
+    uint8_t *officers;
+    size_t num_officers;
+    // Customers waiting in the queue of a service and servings of a service not called yet
+    int64_t waiting[UINT16_MAX + 1];
+    int64_t serving[UINT16_MAX + 1];
+    bool closed;
+    uint64_t line;
+    uint64_t errors;
+    uint64_t served;
+} Checker;
+
+/*
+ *  Function: parse_number
+ *  ----------------------
+ *  Reads a decimal number and moves the position after it
+ *  Returns: true (if there was a number)
+ */
+static bool parse_number(const char **pos, const char *end, uint64_t *value)
+{
+    const char *p = *pos;
+    uint64_t v = 0;
+
+    while (p < end && *p >= '0' && *p <= '9') {
+        v = v * 10 + (*p - '0');
+        p++;
+    }
+    if (p == *pos) return false;
+    *pos = p;
+    *value = v;
+    return true;
+}
+
+/*
+ *  Function: skip_text
+ *  -------------------
+ *  Moves the position after the text if it follows
+ *  Returns: true (if the text followed)
+ */
+static bool skip_text(const char **pos, const char *end, const char *text, size_t len)
+{
+    if ((size_t)(end - *pos) < len || memcmp(*pos, text, len) != 0) return false;
+    *pos += len;
+    return true;
+}
+
+#define SKIP(pos, end, text) skip_text(pos, end, text, sizeof(text) - 1)
+
+/*
+ *  Function: parse_line
+ *  --------------------
+ *  Parses the line after its number and ": "
+ *  Returns: the event of the line, EV_BAD_LINE if it is not a proj2 line
+ */
+static Event parse_line(const char *p, const char *end, Line *line)
+{
+    uint64_t value;
+
+    if (SKIP(&p, end, "closing")) return p == end ? EV_CLOSING : EV_BAD_LINE;
+    if (SKIP(&p, end, "scaling ")) return EV_SCALING;
+
+    bool customer = SKIP(&p, end, "Z ");
+    if (!customer && !SKIP(&p, end, "U ")) return EV_BAD_LINE;
+    if (!parse_number(&p, end, &value) || value == 0 || value > UINT32_MAX || !SKIP(&p, end, ": ")) return EV_BAD_LINE;
+    line->id = (uint32_t)value;
+
+    Event event = EV_BAD_LINE;
+    bool service = false;
+    if (SKIP(&p, end, "started")) event = customer ? EV_Z_STARTED : EV_U_STARTED;
+    else if (SKIP(&p, end, "going home")) event = customer ? EV_Z_GOING_HOME : EV_U_GOING_HOME;
+    else if (customer && SKIP(&p, end, "entering office for a service ")) event = EV_Z_ENTERING, service = true;
+    else if (customer && SKIP(&p, end, "called by office worker")) event = EV_Z_CALLED;
+    else if (!customer && SKIP(&p, end, "serving a service of type ")) event = EV_U_SERVING, service = true;
+    else if (!customer && SKIP(&p, end, "service finished")) event = EV_U_SERVICE_FINISHED;
+    else if (!customer && SKIP(&p, end, "taking break")) event = EV_U_TAKING_BREAK;
+    else if (!customer && SKIP(&p, end, "break finished")) event = EV_U_BREAK_FINISHED;
+
+    if (service) {
+        if (!parse_number(&p, end, &value) || value == 0 || value > UINT16_MAX) return EV_BAD_LINE;
+        line->service = (uint16_t)value;
+    }
+    return p == end ? event : EV_BAD_LINE;
+}
+
+/*
+ *  Function: parse_chunk
+ *  ---------------------
+ *  Thread parsing the lines of a chunk into records,
+ *  line numbers must follow each other within the chunk,
+ *  after a gap they are followed from the new number
+ */
+static void *parse_chunk(void *arg)
+{
+    Chunk *chunk = arg;
+    const char *p = chunk->begin;
+
+    while (p < chunk->end)
+    {
+        const char *end = memchr(p, '\n', chunk->end - p);
+        if (end == NULL) end = chunk->end;
+
+        if (chunk->count == chunk->capacity) {
+            chunk->capacity = chunk->capacity ? 2 * chunk->capacity : 1024;
+            chunk->lines = realloc(chunk->lines, chunk->capacity * sizeof(Line));
+            if (chunk->lines == NULL) {
+                fprintf(stderr, "proj2-check: out of memory\n");
+                exit(2);
+            }
+        }
+
+        Line *line = &chunk->lines[chunk->count];
+        const char *q = p;
+        uint64_t number;
+        line->id = 0;
+        line->service = 0;
+        line->gap = false;
+
+        if (!parse_number(&q, end, &number) || !SKIP(&q, end, ": ")) {
+            line->event = EV_BAD_LINE;
+            chunk->last = 0;
+        } else {
+            line->event = parse_line(q, end, line);
+            if (chunk->count == 0) chunk->first = number;
+            else line->gap = chunk->last != 0 && number != chunk->last + 1;
+            chunk->last = number;
+        }
+        chunk->count++;
+        p = end + 1;
+    }
+    return NULL;
+}
+
+/*
+ *  Function: error
+ *  ---------------
+ *  Counts an error of the current line and prints the first ones
+ */
+static void error(Checker *c, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void error(Checker *c, const char *format, ...)
+{
+    if (c->errors++ >= MAX_ERRORS_SHOWN) return;
+
+    va_list args;
+    va_start(args, format);
+    printf("line %" PRIu64 ": ", c->line);
+    vprintf(format, args);
+    putchar('\n');
+    va_end(args);
+}
+
+/*
+ *  Function: grow
+ *  --------------
+ *  Makes room for the state of the id in a zeroed array
+ *  Returns: the array, exits when out of memory
+ */
+static void *grow(void *array, size_t *count, size_t id, size_t size)
+{
+    if (id < *count) return array;
+
+    size_t new_count = *count ? *count : 1024;
+    while (new_count <= id) new_count *= 2;
+    char *grown = realloc(array, new_count * size);
+    if (grown == NULL) {
+        fprintf(stderr, "proj2-check: out of memory\n");
+        exit(2);
+    }
+    memset(grown + *count * size, 0, (new_count - *count) * size);
+    *count = new_count;
+    return grown;
+}
+
+/*
+ *  Function: check_line
+ *  --------------------
+ *  Moves the customer or officer of the line to its next state
+ */
+static void check_line(Checker *c, const Line *line)
+{
+    size_t id = line->id;
+
+    Customer *z = NULL;
+    uint8_t *u = NULL;
+
+    if (line->event >= EV_Z_STARTED && line->event <= EV_Z_GOING_HOME) {
+        c->customers = grow(c->customers, &c->num_customers, id, sizeof(Customer));
+        z = &c->customers[id];
+    } else if (line->event >= EV_U_STARTED) {
+        c->officers = grow(c->officers, &c->num_officers, id, sizeof(uint8_t));
+        u = &c->officers[id];
+    }
+
+    if (line->gap) error(c, "line number out of sequence");
+
+    switch (line->event)
+    {
+        case EV_BAD_LINE:
+            error(c, "not a proj2 line");
+            break;
+        case EV_CLOSING:
+            if (c->closed) error(c, "closing twice");
+            c->closed = true;
+            break;
+        case EV_SCALING:
+            if (c->closed) error(c, "scaling after closing");
+            break;
+        case EV_Z_STARTED:
+            if (z->state != Z_NONE) error(c, "Z %zu started twice", id);
+            z->state = Z_STARTED;
+            break;
+        case EV_Z_ENTERING:
+            if (z->state != Z_STARTED) error(c, "Z %zu entering without starting", id);
+            if (c->closed) error(c, "Z %zu entering after closing", id);
+            z->service = line->service;
+            c->waiting[line->service]++;
+            z->state = Z_ENTERED;
+            break;
+        case EV_Z_CALLED:
+            if (z->state != Z_ENTERED) {
+                error(c, "Z %zu called without entering", id);
+            } else if (c->serving[z->service]-- <= 0) {
+                error(c, "Z %zu called but no officer serves service %d", id, z->service);
+            }
+            z->state = Z_CALLED;
+            break;
+        case EV_Z_GOING_HOME:
+            if (z->state == Z_STARTED && !c->closed) error(c, "Z %zu going home while the post is open", id);
+            else if (z->state != Z_STARTED && z->state != Z_CALLED) error(c, "Z %zu going home without being served", id);
+            z->state = Z_HOME;
+            break;
+        case EV_U_STARTED:
+            // An officer sent home by the autoscaler may come back
+            if (*u != U_NONE && *u != U_HOME) error(c, "U %zu started twice", id);
+            *u = U_READY;
+            break;
+        case EV_U_SERVING:
+            if (*u != U_READY) error(c, "U %zu serving while not ready", id);
+            if (c->waiting[line->service]-- <= 0) {
+                error(c, "U %zu serving service %d nobody waits for", id, line->service);
+            }
+            c->serving[line->service]++;
+            c->served++;
+            *u = U_SERVING;
+            break;
+        case EV_U_SERVICE_FINISHED:
+            if (*u != U_SERVING) error(c, "U %zu finished a service it did not serve", id);
+            *u = U_READY;
+            break;
+        case EV_U_TAKING_BREAK:
+            if (*u != U_READY) error(c, "U %zu taking break while not ready", id);
+            if (c->closed) error(c, "U %zu taking break after closing", id);
+            *u = U_BREAK;
+            break;
+        case EV_U_BREAK_FINISHED:
+            if (*u != U_BREAK) error(c, "U %zu finished a break it did not take", id);
+            *u = U_READY;
+            break;
+        case EV_U_GOING_HOME:
+            if (*u != U_READY) error(c, "U %zu going home while not ready", id);
+            *u = U_HOME;
+            break;
+    }
+}
+
+/*
+ *  Function: check_end
+ *  -------------------
+ *  Everybody must have gone home and every serving been called
+ */
+static void check_end(Checker *c)
+{
+    if (!c->closed) error(c, "the post never closed");
+    for (size_t i = 1; i < c->num_customers; i++) {
+        if (c->customers[i].state != Z_NONE && c->customers[i].state != Z_HOME) {
+            error(c, "Z %zu never went home", i);
+        }
+    }
+    for (size_t i = 1; i < c->num_officers; i++) {
+        if (c->officers[i] != U_NONE && c->officers[i] != U_HOME) {
+            error(c, "U %zu never went home", i);
+        }
+    }
+    for (size_t i = 1; i <= UINT16_MAX; i++) {
+        if (c->waiting[i] > 0) error(c, "%" PRId64 " customers of service %zu were never served", c->waiting[i], i);
+    }
+}
+
+/***    MAIN    ***/
+int main(int argc, char *argv[])
+{
+    static struct option long_options[] = {
+        {"threads", required_argument, NULL, 't'},
+        {NULL, 0, NULL, 0}
+    };
+
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1)
+    {
+        switch(opt)
+        {
+            case 't':
+                num_threads = atol(optarg);
+                if (num_threads < 1 || num_threads > MAX_THREADS) {
+                    fprintf(stderr, "proj2-check: --threads must be 1 to %d\n", MAX_THREADS);
+                    return 2;
+                }
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [--threads=N] [FILE]\n", argv[0]);
+                return 2;
+        }
+    }
+    const char *path = optind < argc ? argv[optind] : "proj2.out";
+
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        fprintf(stderr, "proj2-check: cannot open %s: %s\n", path, strerror(errno));
+        return 2;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        fprintf(stderr, "proj2-check: %s is not a regular file\n", path);
+        return 2;
+    }
+    size_t size = st.st_size;
+    const char *data = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : "";
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "proj2-check: cannot map %s: %s\n", path, strerror(errno));
+        return 2;
+    }
+    if (size > 0) madvise((void *)data, size, MADV_SEQUENTIAL);
+
+    // Chunks end after a newline
+    if ((size_t)num_threads > size / MIN_CHUNK + 1) num_threads = size / MIN_CHUNK + 1;
+    Chunk chunks[MAX_THREADS] = { 0 };
+    pthread_t threads[MAX_THREADS];
+    const char *begin = data;
+    for (long i = 0; i < num_threads; i++) {
+        const char *end = i + 1 == num_threads ? data + size : data + size / num_threads * (i + 1);
+        if (end < begin) end = begin;
+        const char *newline = end < data + size ? memchr(end, '\n', data + size - end) : NULL;
+        if (i + 1 < num_threads) end = newline != NULL ? newline + 1 : data + size;
+
+        chunks[i].begin = begin;
+        chunks[i].end = end;
+        begin = end;
+        if (pthread_create(&threads[i], NULL, parse_chunk, &chunks[i]) != 0) {
+            parse_chunk(&chunks[i]);
+            threads[i] = 0;
+        }
+    }
+    for (long i = 0; i < num_threads; i++) {
+        if (threads[i] != 0) pthread_join(threads[i], NULL);
+    }
+
+    // The first line of a chunk follows the last line of the previous one,
+    // after a bad line the numbers are not compared as within a chunk
+    static Checker c;
+    uint64_t last = 0;
+    bool first_chunk = true;
+    for (long i = 0; i < num_threads; i++) {
+        Chunk *chunk = &chunks[i];
+        if (chunk->count == 0) continue;
+
+        if (chunk->lines[0].event != EV_BAD_LINE) {
+            chunk->lines[0].gap = first_chunk ? chunk->first != 1 : last != 0 && chunk->first != last + 1;
+        }
+        first_chunk = false;
+        for (size_t j = 0; j < chunk->count; j++) {
+            c.line++;
+            check_line(&c, &chunk->lines[j]);
+        }
+        last = chunk->last;
+        free(chunk->lines);
+    }
+    check_end(&c);
+
+    size_t customers = 0, officers = 0;
+    for (size_t i = 1; i < c.num_customers; i++) customers += c.customers[i].state != Z_NONE;
+    for (size_t i = 1; i < c.num_officers; i++) officers += c.officers[i] != U_NONE;
+
+    if (c.errors > MAX_ERRORS_SHOWN) printf("... %" PRIu64 " more errors\n", c.errors - MAX_ERRORS_SHOWN);
+    printf("%s: %" PRIu64 " lines, %zu customers, %zu officers, %" PRIu64 " served, %" PRIu64 " errors\n",
+           path, c.line, customers, officers, c.served, c.errors);
+    return c.errors > 0;
+}
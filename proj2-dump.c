@@ -0,0 +1,115 @@
+/**************************/
+/* *  Daniel Sehnoutek  * */
+/* *        IOS2        * */
+/**************************/
+
+/*
+ *  proj2-dump - converts the binary log of proj2 --binary-log
+ *  into the text of proj2.out, optionally with the time of every line
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "proj2.h"
+
+// Lines formatted before one write
+#define DUMP_BATCH 4096
+
+/***    MAIN    ***/
+int main(int argc, char *argv[])
+{
+    static struct option long_options[] = {
+        {"timestamps", no_argument, NULL, 't'},
+        {NULL, 0, NULL, 0}
+    };
+
+    bool timestamps = false;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1)
+    {
+        switch(opt)
+        {
+            case 't':
+                timestamps = true;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [--timestamps] [FILE]\n", argv[0]);
+                return 1;
+        }
+    }
+    const char *path = optind < argc ? argv[optind] : LOG_FILE_NAME;
+
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        fprintf(stderr, "proj2-dump: cannot open %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    if ((size_t)st.st_size < sizeof(LogFileHeader)) {
+        fprintf(stderr, "proj2-dump: %s is not a proj2 binary log\n", path);
+        return 1;
+    }
+    const char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "proj2-dump: cannot map %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
+
+    LogFileHeader header;
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, LOG_FILE_MAGIC, sizeof(header.magic)) != 0 || header.version != LOG_FILE_VERSION
+        || header.record_size != sizeof(LogFileRecord)) {
+        fprintf(stderr, "proj2-dump: %s is not a proj2 binary log of version %d\n", path, LOG_FILE_VERSION);
+        return 1;
+    }
+
+    size_t count = (st.st_size - sizeof(header)) / sizeof(LogFileRecord);
+    if ((st.st_size - sizeof(header)) % sizeof(LogFileRecord) != 0) {
+        fprintf(stderr, "proj2-dump: %s ends with a partial record\n", path);
+    }
+
+    // Room for the timestamp in front of every line
+    static char buf[DUMP_BATCH * (LOG_LINE_MAX + 24)];
+    const char *records = data + sizeof(header);
+    size_t len = 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        LogFileRecord r;
+        memcpy(&r, records + i * sizeof(r), sizeof(r));
+        if (r.event > LOG_SCALE_DOWN || r.type > URADNIK) {
+            fprintf(stderr, "proj2-dump: record %zu of %s is damaged\n", i + 1, path);
+            return 1;
+        }
+
+        if (timestamps) {
+            len += snprintf(buf + len, 24, "%" PRId64 ".%09" PRId64 " ", r.time_ns / 1000000000, r.time_ns % 1000000000);
+        }
+        len += log_format_line(buf + len, r.seq, r.type, r.id, r.event, r.service);
+
+        if ((i + 1) % DUMP_BATCH == 0 || i + 1 == count) {
+            if (fwrite(buf, 1, len, stdout) != len) {
+                fprintf(stderr, "proj2-dump: write failed\n");
+                return 1;
+            }
+            len = 0;
+        }
+    }
+
+    if (fflush(stdout) == EOF) {
+        fprintf(stderr, "proj2-dump: write failed\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,282 @@
+/**************************/
+/* *  Daniel Sehnoutek  * */
+/* *        IOS2        * */
+/**************************/
+
+/*
+ *  proj2-load - load generator of the server mode (proj2 --server=PATH)
+ *  Keeps C connections open to the UNIX socket, each one customer asking
+ *  for a service, and reports the requests per second and the latency
+ *  from the connect to the answer
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <getopt.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+
+#include "proj2.h"
+
+// Events handled in one epoll_wait
+#define LOAD_EVENTS 256
+
+// Milliseconds without any answer after which the run gives up
+#define LOAD_TIMEOUT_MS 30000
+
+/*
+ *  Structure: Connection
+ *  ---------------------
+ *  One customer in flight, fd is -1 when the connection is free
+ */
+typedef struct {
+    int fd;
+    bool sent;
+    int64_t start_ns;
+    int len;
+    char answer[SERVER_LINE_MAX];
+} Connection;
+
+typedef enum {
+    ANSWER_CALLED,
+    ANSWER_CLOSED,
+    ANSWER_BUSY,
+    ANSWER_OTHER,
+    ANSWERS
+} Answer;
+
+static const char *answer_names[ANSWERS] = {
+    [ANSWER_CALLED] = "called",
+    [ANSWER_CLOSED] = "closed",
+    [ANSWER_BUSY] = "busy",
+    [ANSWER_OTHER] = "failed",
+};
+
+/*
+ *  Function: now_ns
+ *  ----------------
+ *  Returns: monotonic time in nanoseconds
+ */
+int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ *  Function: compare_latency
+ *  -------------------------
+ *  Orders the latencies for the percentiles
+ */
+int compare_latency(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ *  Function: start_connection
+ *  --------------------------
+ *  Connects a free connection to the server, the request
+ *  is sent once the socket is writable
+ *  Returns: 0 (if connecting)
+ *           else (the server does not accept now)
+ */
+int start_connection(Connection *c, int epoll_fd, const struct sockaddr_un *addr)
+{
+    c->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd == -1) return 1;
+
+    c->sent = false;
+    c->len = 0;
+    c->answer[0] = '\0';
+    c->start_ns = now_ns();
+    if (connect(c->fd, (const struct sockaddr *)addr, sizeof(*addr)) == -1 && errno != EINPROGRESS) {
+        close(c->fd);
+        c->fd = -1;
+        return 1;
+    }
+
+    struct epoll_event ev = { .events = EPOLLOUT | EPOLLIN, .data.ptr = c };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->fd, &ev);
+    return 0;
+}
+
+/*
+ *  Function: classify
+ *  ------------------
+ *  Returns: the kind of the answer of the server
+ */
+Answer classify(const char *answer)
+{
+    if (strcmp(answer, SERVER_CALLED) == 0) return ANSWER_CALLED;
+    if (strcmp(answer, SERVER_CLOSED) == 0) return ANSWER_CLOSED;
+    if (strcmp(answer, SERVER_BUSY) == 0) return ANSWER_BUSY;
+    return ANSWER_OTHER;
+}
+
+/***    MAIN    ***/
+int main(int argc, char *argv[])
+{
+    static struct option long_options[] = {
+        {"connections", required_argument, NULL, 'c'},
+        {"requests", required_argument, NULL, 'n'},
+        {"service", required_argument, NULL, 's'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int num_connections = 1000;
+    long num_requests = 10000;
+    int service = 0;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1)
+    {
+        switch(opt)
+        {
+            case 'c':
+                num_connections = atoi(optarg);
+                break;
+            case 'n':
+                num_requests = atol(optarg);
+                break;
+            case 's':
+                service = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [--connections=C] [--requests=N] [--service=S] PATH\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind + 1 != argc || num_connections < 1 || num_requests < 1 || service < 0) {
+        fprintf(stderr, "Usage: %s [--connections=C] [--requests=N] [--service=S] PATH\n", argv[0]);
+        return 1;
+    }
+    if (num_connections > num_requests) num_connections = num_requests;
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(argv[optind]) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "proj2-load: the socket path %s is too long\n", argv[optind]);
+        return 1;
+    }
+    strcpy(addr.sun_path, argv[optind]);
+
+    // Every connection is a descriptor
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    char request[SERVER_LINE_MAX];
+    int request_len = snprintf(request, sizeof(request), SERVER_ENTER " %d\n", service);
+
+    Connection *connections = calloc(num_connections, sizeof(Connection));
+    int64_t *latency = malloc(num_requests * sizeof(int64_t));
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (connections == NULL || latency == NULL || epoll_fd == -1) {
+        fprintf(stderr, "proj2-load: failed to allocate %d connections\n", num_connections);
+        return 1;
+    }
+
+    long started = 0, finished = 0, num_latency = 0;
+    long answers[ANSWERS] = { 0 };
+    int in_flight = 0;
+    int64_t start = now_ns();
+    int64_t last_answer = start;
+
+    for (int i = 0; i < num_connections; i++) connections[i].fd = -1;
+
+    bool gone = false;
+    while (finished < num_requests && !gone)
+    {
+        // Free connections take the next requests, a refused connect is retried later
+        for (int i = 0; i < num_connections && started < num_requests && in_flight < num_connections; i++) {
+            if (connections[i].fd != -1) continue;
+            if (start_connection(&connections[i], epoll_fd, &addr) != 0) {
+                // The server that closed its socket answered all it took
+                bool refused = errno == ECONNREFUSED || errno == ENOENT;
+                if (!refused && errno != EAGAIN && errno != EMFILE && errno != ENFILE) {
+                    fprintf(stderr, "proj2-load: cannot connect to %s: %s\n", addr.sun_path, strerror(errno));
+                    return 1;
+                }
+                if (refused && in_flight == 0) {
+                    fprintf(stderr, "proj2-load: %s is not served\n", addr.sun_path);
+                    gone = true;
+                }
+                break;
+            }
+            started++;
+            in_flight++;
+        }
+
+        struct epoll_event events[LOAD_EVENTS];
+        int n = epoll_wait(epoll_fd, events, LOAD_EVENTS, 10);
+        if (n == 0 && now_ns() - last_answer > (int64_t)LOAD_TIMEOUT_MS * 1000000) {
+            fprintf(stderr, "proj2-load: no answer for %d ms, %d requests left in flight\n", LOAD_TIMEOUT_MS, in_flight);
+            break;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            Connection *c = events[i].data.ptr;
+            bool done = false;
+
+            // A server that answered BUSY or CLOSED and closed fails the send,
+            // its answer is still read from the socket
+            if (!c->sent && (events[i].events & EPOLLOUT)) {
+                if (send(c->fd, request, request_len, MSG_NOSIGNAL) == request_len || errno != EAGAIN) {
+                    c->sent = true;
+                    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+                    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+                }
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                ssize_t got = read(c->fd, c->answer + c->len, sizeof(c->answer) - 1 - c->len);
+                if (got > 0) {
+                    c->len += got;
+                    c->answer[c->len] = '\0';
+                    done = strchr(c->answer, '\n') != NULL || c->len == sizeof(c->answer) - 1;
+                } else if (got == 0 || errno != EAGAIN) {
+                    done = true;
+                }
+            }
+            if (!done) continue;
+
+            Answer answer = classify(c->answer);
+            answers[answer]++;
+            if (answer == ANSWER_CALLED) latency[num_latency++] = now_ns() - c->start_ns;
+            close(c->fd);
+            c->fd = -1;
+            in_flight--;
+            finished++;
+            last_answer = now_ns();
+        }
+    }
+
+    double wall_s = (now_ns() - start) / 1e9;
+    qsort(latency, num_latency, sizeof(int64_t), compare_latency);
+
+    printf("%ld requests over %d connections in %.3f s, %.0f requests/s\n", finished, num_connections, wall_s,
+           wall_s > 0 ? finished / wall_s : 0.0);
+    for (int i = 0; i < ANSWERS; i++) {
+        printf("%s %ld%s", answer_names[i], answers[i], i + 1 < ANSWERS ? ", " : "\n");
+    }
+    if (num_latency > 0) {
+        printf("latency of called: p50 %.1f us, p99 %.1f us, max %.1f us\n", latency[num_latency / 2] / 1e3,
+               latency[(num_latency * 99) / 100] / 1e3, latency[num_latency - 1] / 1e3);
+    }
+
+    free(latency);
+    free(connections);
+    close(epoll_fd);
+    return finished < num_requests;
+}
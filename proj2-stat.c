@@ -0,0 +1,264 @@
+/**************************/
+/* *  Daniel Sehnoutek  * */
+/* *        IOS2        * */
+/**************************/
+
+/*
+ *  proj2-stat - top-like view of a running proj2
+ *  Attaches read-only to the statistics /proj2-stats.<pid>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "proj2.h"
+
+// Directory of the POSIX shared memory objects
+#define SHM_DIR "/dev/shm"
+
+// Queues shown at most, the longest ones
+#define MAX_LANES_SHOWN 20
+
+// Officers shown in one line of states
+#define OFFICERS_PER_LINE 64
+
+static const char officer_state_letters[] = {
+    [OFFICER_STARTING] = '.',
+    [OFFICER_IDLE] = 'I',
+    [OFFICER_SERVING] = 'S',
+    [OFFICER_BREAK] = 'B',
+    [OFFICER_HOME] = 'H',
+};
+
+/*
+ *  Function: now_ns
+ *  ----------------
+ *  Returns: monotonic time in nanoseconds, the clock of proj2
+ */
+int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ *  Function: find_newest
+ *  ---------------------
+ *  Finds the statistics of the most recently started proj2
+ *  Returns: 0 (if the name was stored)
+ *           else (no proj2 is running)
+ */
+int find_newest(char *name)
+{
+    DIR *dir = opendir(SHM_DIR);
+    if (dir == NULL) return 1;
+
+    const char *prefix = STATS_NAME_FORMAT + 1;
+    size_t prefix_len = strchr(prefix, '%') - prefix;
+    struct dirent *entry;
+    time_t newest = 0;
+    int found = 1;
+
+    while ((entry = readdir(dir)) != NULL) {
+        struct stat st;
+        char path[sizeof(SHM_DIR) + 256];
+
+        size_t len = strlen(entry->d_name);
+        if (strncmp(entry->d_name, prefix, prefix_len) != 0 || len + 2 > STATS_NAME_MAX) continue;
+        snprintf(path, sizeof(path), "%s/%s", SHM_DIR, entry->d_name);
+        if (stat(path, &st) != 0 || (found == 0 && st.st_mtime < newest)) continue;
+
+        newest = st.st_mtime;
+        name[0] = '/';
+        memcpy(name + 1, entry->d_name, len + 1);
+        found = 0;
+    }
+    closedir(dir);
+    return found;
+}
+
+/*
+ *  Function: attach
+ *  ----------------
+ *  Maps the statistics read-only and checks their version
+ *  Returns: the statistics, NULL on failure
+ */
+StatsBlock *attach(const char *name)
+{
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1) {
+        fprintf(stderr, "proj2-stat: cannot open %s: %s\n", name, strerror(errno));
+        return NULL;
+    }
+
+    struct stat st;
+    StatsBlock *stats = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(StatsBlock)) {
+        stats = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (stats == MAP_FAILED) {
+        fprintf(stderr, "proj2-stat: cannot map %s\n", name);
+        return NULL;
+    }
+
+    if (atomic_load(&stats->magic) != STATS_MAGIC || stats->version != STATS_VERSION
+        || stats->size > (uint64_t)st.st_size) {
+        fprintf(stderr, "proj2-stat: %s is not a proj2 statistics of version %d\n", name, STATS_VERSION);
+        munmap(stats, st.st_size);
+        return NULL;
+    }
+    return stats;
+}
+
+/*
+ *  Function: print_view
+ *  --------------------
+ *  Prints one screen of the statistics, lines per second
+ *  are counted since the previous screen
+ */
+void print_view(StatsBlock *stats, uint64_t *last_lines, int64_t *last_ns)
+{
+    OfficerStats *officers = stats_officers(stats);
+    LaneStats *lanes = stats_lanes(stats);
+    int64_t now = now_ns();
+
+    uint64_t served = 0;
+    int states[OFFICER_HOME + 1] = { 0 };
+    for (int i = 0; i < stats->num_officers; i++) {
+        served += atomic_load_explicit(&officers[i].served, memory_order_relaxed);
+        int state = atomic_load_explicit(&officers[i].state, memory_order_relaxed);
+        if (state >= OFFICER_STARTING && state <= OFFICER_HOME) states[state]++;
+    }
+
+    // The longest queues, insertion into a short sorted list
+    int shown[MAX_LANES_SHOWN];
+    int lengths[MAX_LANES_SHOWN];
+    int num_shown = 0;
+    long waiting = 0;
+    for (int i = 0; i < stats->num_services; i++) {
+        int length = atomic_load_explicit(&lanes[i].length, memory_order_relaxed);
+        waiting += length;
+        if (length == 0) continue;
+
+        int j;
+        if (num_shown < MAX_LANES_SHOWN) j = num_shown++;
+        else if (length > lengths[MAX_LANES_SHOWN - 1]) j = MAX_LANES_SHOWN - 1;
+        else continue;
+
+        for (; j > 0 && lengths[j - 1] < length; j--) {
+            shown[j] = shown[j - 1];
+            lengths[j] = lengths[j - 1];
+        }
+        shown[j] = i;
+        lengths[j] = length;
+    }
+
+    uint64_t lines = atomic_load_explicit(&stats->log_lines, memory_order_relaxed);
+    double interval_s = (now - *last_ns) / 1e9;
+    double lines_per_s = *last_ns > 0 && interval_s > 0 ? (lines - *last_lines) / interval_s : 0.0;
+    *last_lines = lines;
+    *last_ns = now;
+
+    printf("proj2 %d   elapsed %.1f s   office %s%s\n", stats->pid, (now - stats->start_ns) / 1e9,
+           atomic_load(&stats->closed) ? "closed" : "open", atomic_load(&stats->finished) ? ", finished" : "");
+    printf("customers %6d   done %6d   served %6" PRIu64 "   turned away %6d   waiting %6ld\n",
+           stats->num_customers, atomic_load(&stats->customers_done), served,
+           atomic_load(&stats->turned_away), waiting);
+    printf("officers  %6d   at work %4d   serving %4d   idle %4d   break %4d   home %4d\n",
+           stats->num_officers, atomic_load(&stats->active_officers), states[OFFICER_SERVING], states[OFFICER_IDLE],
+           states[OFFICER_BREAK], states[OFFICER_HOME]);
+    printf("log lines %10" PRIu64 "   %.0f lines/s\n\n", lines, lines_per_s);
+
+    printf("officer states (S serving, I idle, B break, H home, . starting)\n");
+    for (int i = 0; i < stats->num_officers; i++) {
+        int state = atomic_load_explicit(&officers[i].state, memory_order_relaxed);
+        putchar(state >= OFFICER_STARTING && state <= OFFICER_HOME ? officer_state_letters[state] : '?');
+        if ((i + 1) % OFFICERS_PER_LINE == 0 || i + 1 == stats->num_officers) putchar('\n');
+    }
+
+    printf("\nservice   queue\n");
+    for (int i = 0; i < num_shown; i++) {
+        printf("%7d %7d ", shown[i] + 1, lengths[i]);
+        for (int j = 0; j < lengths[i] && j < 60; j++) putchar('#');
+        putchar('\n');
+    }
+    if (num_shown == 0) printf("      all queues are empty\n");
+    fflush(stdout);
+}
+
+/***    MAIN    ***/
+int main(int argc, char *argv[])
+{
+    static struct option long_options[] = {
+        {"interval", required_argument, NULL, 'i'},
+        {"once", no_argument, NULL, 'o'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int interval_ms = 1000;
+    bool once = false;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1)
+    {
+        switch(opt)
+        {
+            case 'i':
+                interval_ms = atoi(optarg);
+                if (interval_ms <= 0) {
+                    fprintf(stderr, "proj2-stat: invalid interval %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'o':
+                once = true;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [--interval=MS] [--once] [PID]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    char name[STATS_NAME_MAX];
+    if (optind < argc) {
+        snprintf(name, sizeof(name), STATS_NAME_FORMAT, atoi(argv[optind]));
+    } else if (find_newest(name) != 0) {
+        fprintf(stderr, "proj2-stat: no running proj2 found in %s\n", SHM_DIR);
+        return 1;
+    }
+
+    StatsBlock *stats = attach(name);
+    if (stats == NULL) return 1;
+
+    bool clear = !once && isatty(STDOUT_FILENO);
+    uint64_t last_lines = 0;
+    int64_t last_ns = 0;
+
+    while (true)
+    {
+        if (clear) printf("\033[H\033[2J");
+        print_view(stats, &last_lines, &last_ns);
+        if (once || atomic_load(&stats->finished)) break;
+
+        // proj2 killed before it could mark the run finished
+        if (kill(stats->pid, 0) == -1 && errno == ESRCH) {
+            printf("\nproj2 %d is gone\n", stats->pid);
+            break;
+        }
+        usleep(interval_ms * 1000);
+    }
+    return 0;
+}
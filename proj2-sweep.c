@@ -0,0 +1,326 @@
+/**************************/
+/* *  Daniel Sehnoutek  * */
+/* *        IOS2        * */
+/**************************/
+
+/*
+ *  proj2-sweep - runs proj2 over a parameter grid concurrently
+ *  Every run gets its own directory, the --report rows of all
+ *  runs are collected into one CSV file in the order of the grid
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+// Maximal length of a line of the report
+#define ROW_MAX 1024
+
+/*
+ *  Structure: Dimension
+ *  --------------------
+ *  One axis of the grid, option is the proj2 option
+ *  the values are passed with, NULL for positional ones
+ */
+typedef struct {
+    const char *name;
+    const char *option;
+    const char *list;
+    char **values;
+    int count;
+} Dimension;
+
+enum { DIM_MODE, DIM_POLICY, DIM_SERVICES, DIM_BATCH, DIM_MAX_OFF, DIM_N_CUS, DIM_N_OFF, DIM_T_CUS, DIM_T_OFF, DIM_F, DIM_RUN, DIMS };
+
+static Dimension dims[DIMS] = {
+    [DIM_MODE] = { "modes", NULL, "processes,threads,fibers,virtual-time", NULL, 0 },
+    [DIM_POLICY] = { "policies", "--policy=", "random,longest,oldest,round-robin,weighted", NULL, 0 },
+    [DIM_SERVICES] = { "services", "--services=", "3", NULL, 0 },
+    [DIM_BATCH] = { "batch", "--batch=", "1", NULL, 0 },
+    [DIM_MAX_OFF] = { "max-off", "--max-officers=", "0", NULL, 0 },
+    [DIM_N_CUS] = { "n-cus", NULL, "100,1000", NULL, 0 },
+    [DIM_N_OFF] = { "n-off", NULL, "1,4", NULL, 0 },
+    [DIM_T_CUS] = { "t-cus", NULL, "0,100", NULL, 0 },
+    [DIM_T_OFF] = { "t-off", NULL, "0,10", NULL, 0 },
+    [DIM_F] = { "f", NULL, "100", NULL, 0 },
+    [DIM_RUN] = { "runs", NULL, "1", NULL, 0 },
+};
+
+/*
+ *  Structure: Job
+ *  --------------
+ *  One run of proj2 and its result
+ */
+typedef struct {
+    pid_t pid;
+    char dir[32];
+    char *row;
+} Job;
+
+/*
+ *  Function: split_list
+ *  --------------------
+ *  Splits the comma separated values of a dimension
+ *  Returns: 0 (if the list has at least one value)
+ *           else (not)
+ */
+int split_list(Dimension *d)
+{
+    char *copy = strdup(d->list);
+    if (copy == NULL) return 1;
+
+    d->count = 1;
+    for (char *c = copy; *c != '\0'; c++) {
+        if (*c == ',') d->count++;
+    }
+    d->values = malloc(d->count * sizeof(char *));
+    if (d->values == NULL) return 1;
+
+    d->count = 0;
+    for (char *save = NULL, *value = strtok_r(copy, ",", &save); value != NULL; value = strtok_r(NULL, ",", &save)) {
+        d->values[d->count++] = value;
+    }
+    return d->count == 0;
+}
+
+/*
+ *  Function: start_job
+ *  -------------------
+ *  Starts proj2 with the values of the grid point in a new directory
+ *  Returns: 0 (if the run was started)
+ *           -1 (if the grid point is skipped)
+ *           else (failure)
+ */
+int start_job(Job *job, long index, const char *proj2)
+{
+    const char *value[DIMS];
+    for (int i = DIMS - 1; i >= 0; i--) {
+        value[i] = dims[i].values[index % dims[i].count];
+        index /= dims[i].count;
+    }
+
+    // The autoscaler needs real time and starts from N_OFF
+    int max_off = atoi(value[DIM_MAX_OFF]);
+    if (max_off != 0 && (strcmp(value[DIM_MODE], "virtual-time") == 0 || max_off < atoi(value[DIM_N_OFF]))) {
+        return -1;
+    }
+
+    strcpy(job->dir, "/tmp/proj2-sweep.XXXXXX");
+    if (mkdtemp(job->dir) == NULL) {
+        perror("proj2-sweep: mkdtemp");
+        return 1;
+    }
+
+    job->pid = fork();
+    if (job->pid == -1) {
+        perror("proj2-sweep: fork");
+        return 1;
+    }
+    if (job->pid > 0) return 0;
+
+    // The child runs proj2 in its directory, proj2.out and report.csv stay there
+    char options[DIMS][64];
+    char *args[DIMS + 3];
+    int argn = 0;
+
+    args[argn++] = (char *)proj2;
+    if (strcmp(value[DIM_MODE], "threads") == 0) args[argn++] = "--threads";
+    else if (strcmp(value[DIM_MODE], "fibers") == 0) args[argn++] = "--fibers";
+    else if (strcmp(value[DIM_MODE], "virtual-time") == 0) args[argn++] = "--virtual-time";
+    for (int i = DIM_POLICY; i <= DIM_MAX_OFF; i++) {
+        snprintf(options[i], sizeof(options[i]), "%s%s", dims[i].option, value[i]);
+        args[argn++] = options[i];
+    }
+    args[argn++] = "--report=report.csv";
+    for (int i = DIM_N_CUS; i <= DIM_F; i++) {
+        args[argn++] = (char *)value[i];
+    }
+    args[argn] = NULL;
+
+    if (chdir(job->dir) == -1 || freopen("/dev/null", "w", stdout) == NULL) _exit(127);
+    execv(proj2, args);
+    perror("proj2-sweep: exec");
+    _exit(127);
+}
+
+/*
+ *  Function: finish_job
+ *  --------------------
+ *  Takes the report of a finished run and removes its directory
+ *  Returns: the header of the report, NULL if the run failed
+ */
+char *finish_job(Job *job, int status)
+{
+    char path[64];
+    char header[ROW_MAX];
+    char row[ROW_MAX];
+    char *result = NULL;
+
+    snprintf(path, sizeof(path), "%s/report.csv", job->dir);
+    FILE *report = WIFEXITED(status) && WEXITSTATUS(status) == 0 ? fopen(path, "r") : NULL;
+    if (report != NULL) {
+        if (fgets(header, sizeof(header), report) != NULL && fgets(row, sizeof(row), report) != NULL) {
+            job->row = strdup(row);
+            result = strdup(header);
+        }
+        fclose(report);
+    }
+
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/proj2.out", job->dir);
+    unlink(path);
+    rmdir(job->dir);
+    return result;
+}
+
+/***    MAIN    ***/
+int main(int argc, char *argv[])
+{
+    static struct option long_options[] = {
+        {"jobs", required_argument, NULL, 'j'},
+        {"proj2", required_argument, NULL, 'x'},
+        {"modes", required_argument, NULL, DIM_MODE},
+        {"policies", required_argument, NULL, DIM_POLICY},
+        {"services", required_argument, NULL, DIM_SERVICES},
+        {"batch", required_argument, NULL, DIM_BATCH},
+        {"max-off", required_argument, NULL, DIM_MAX_OFF},
+        {"n-cus", required_argument, NULL, DIM_N_CUS},
+        {"n-off", required_argument, NULL, DIM_N_OFF},
+        {"t-cus", required_argument, NULL, DIM_T_CUS},
+        {"t-off", required_argument, NULL, DIM_T_OFF},
+        {"f", required_argument, NULL, DIM_F},
+        {"runs", required_argument, NULL, DIM_RUN},
+        {NULL, 0, NULL, 0}
+    };
+
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *proj2 = "./proj2";
+    int runs = 1;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1)
+    {
+        switch(opt)
+        {
+            case 'j':
+                jobs = atol(optarg);
+                break;
+            case 'x':
+                proj2 = optarg;
+                break;
+            case DIM_RUN:
+                runs = atoi(optarg);
+                break;
+            case '?':
+                fprintf(stderr, "Usage: %s [--jobs=N] [--proj2=PATH] [--runs=N] [--modes=LIST] [--policies=LIST]"
+                                " [--services=LIST] [--batch=LIST] [--max-off=LIST] [--n-cus=LIST] [--n-off=LIST] [--t-cus=LIST]"
+                                " [--t-off=LIST] [--f=LIST] [OUTPUT]\n", argv[0]);
+                return 1;
+            default:
+                dims[opt].list = optarg;
+                break;
+        }
+    }
+    if (jobs < 1 || runs < 1) {
+        fprintf(stderr, "proj2-sweep: --jobs and --runs must be positive\n");
+        return 1;
+    }
+    const char *out_path = optind < argc ? argv[optind] : "sweep_results.csv";
+
+    char proj2_path[PATH_MAX];
+    if (realpath(proj2, proj2_path) == NULL || access(proj2_path, X_OK) != 0) {
+        fprintf(stderr, "proj2-sweep: %s not found, run make first\n", proj2);
+        return 1;
+    }
+
+    // Runs are the last dimension, numbered from 1
+    char run_list[16 * 1024] = "";
+    for (int r = 1; r <= runs && strlen(run_list) + 16 < sizeof(run_list); r++) {
+        snprintf(run_list + strlen(run_list), 16, r == 1 ? "%d" : ",%d", r);
+    }
+    dims[DIM_RUN].list = run_list;
+
+    long total = 1;
+    for (int i = 0; i < DIMS; i++) {
+        if (split_list(&dims[i]) != 0) {
+            fprintf(stderr, "proj2-sweep: empty list of %s\n", dims[i].name);
+            return 1;
+        }
+        total *= dims[i].count;
+    }
+    for (int i = 0; i < dims[DIM_MODE].count; i++) {
+        const char *mode = dims[DIM_MODE].values[i];
+        if (strcmp(mode, "processes") != 0 && strcmp(mode, "threads") != 0 && strcmp(mode, "fibers") != 0
+            && strcmp(mode, "virtual-time") != 0) {
+            fprintf(stderr, "proj2-sweep: unknown mode %s\n", mode);
+            return 1;
+        }
+    }
+
+    Job *job = calloc(total, sizeof(Job));
+    if (job == NULL) {
+        fprintf(stderr, "proj2-sweep: failed to allocate %ld runs\n", total);
+        return 1;
+    }
+
+    char *header = NULL;
+    long next = 0, running = 0, done = 0, failed = 0, skipped = 0;
+
+    while (done < total)
+    {
+        while (running < jobs && next < total) {
+            int started = start_job(&job[next], next, proj2_path);
+            if (started == 0) {
+                running++;
+            } else {
+                if (started > 0) failed++;
+                else skipped++;
+                done++;
+            }
+            next++;
+        }
+        if (running == 0) continue;
+
+        int status;
+        pid_t pid = wait(&status);
+        if (pid == -1) break;
+
+        long i = 0;
+        while (i < next && job[i].pid != pid) i++;
+        if (i == next) continue;
+        running--;
+        done++;
+
+        char *job_header = finish_job(&job[i], status);
+        if (job_header == NULL) {
+            fprintf(stderr, "proj2-sweep: run %ld failed\n", i + 1);
+            failed++;
+            continue;
+        }
+        if (header == NULL) header = job_header;
+        else free(job_header);
+        fprintf(stderr, "[%ld/%ld] %s", done, total, job[i].row);
+    }
+
+    FILE *out = fopen(out_path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "proj2-sweep: cannot open %s\n", out_path);
+        return 1;
+    }
+    if (header != NULL) fprintf(out, "run,%s", header);
+    for (long i = 0; i < total; i++) {
+        if (job[i].row != NULL) fprintf(out, "%s,%s", dims[DIM_RUN].values[i % runs], job[i].row);
+    }
+    if (fclose(out) == EOF) {
+        fprintf(stderr, "proj2-sweep: failed to write %s\n", out_path);
+        return 1;
+    }
+
+    fprintf(stderr, "Results of %ld runs written to %s\n", total - failed - skipped, out_path);
+    return failed > 0;
+}
@@ -3,22 +3,75 @@
 /* *        IOS2        * */
 /**************************/
 
+// CPU sets, sched_setaffinity and sched_getcpu (--officer-cpus, --customer-cpus)
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/ipc.h>   
-#include <sys/shm.h>
 #include <semaphore.h>
 #include <time.h>
 #include <sys/wait.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/prctl.h>
+#include <signal.h>
+#include <dirent.h>
+#include <math.h>
+#include <limits.h>
+#include <ucontext.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+
+#include "proj2.h"
+
+/*
+ *  Structure: Rng
+ *  --------------
+ *  State of the xoshiro256** generator of one worker
+ */
+typedef struct {
+    uint64_t s[4];
+} Rng;
 
 typedef enum {
-    MAIN,
-    ZAKAZNIK,
-    URADNIK
-} ProcessType;
+    DECISION_ARRIVAL,
+    DECISION_SERVICE,
+    DECISION_LEAVE,
+    DECISION_BREAK,
+    DECISION_TASK,
+    DECISION_LANE,
+    DECISION_CLOSE,
+    DECISION_GAP,
+    DECISION_BURST
+} DecisionKind;
+
+/*
+ *  Structure: Decision
+ *  -------------------
+ *  One random decision of a worker (role and id) in the file of --record,
+ *  the value is the drawn time, service, queue or burst
+ */
+typedef struct {
+    int64_t value;
+    int32_t id;
+    uint8_t role;
+    uint8_t kind;
+    uint16_t reserved;
+} Decision;
 
 /*
  *  Structure: ProcessInfo
@@ -28,30 +81,358 @@ typedef enum {
 typedef struct {
     ProcessType type;
     int id;
+    // Customer slot in the shared memory, the id except in the streaming mode
+    int slot;
+    // Position of the round-robin scheduler
+    int next_lane;
+    Rng rng;
+    // Decisions not written to the file of --record yet
+    Decision *recorded;
+    int num_recorded;
+    int recorded_capacity;
 } ProcessInfo;
 
+/*
+ *  Structure: LogRecord
+ *  --------------------
+ *  One slot of the log ring buffer
+ *  sequence tells whether the slot is free for the
+ *  producer of a line or holds a line for the writer,
+ *  time_ns is only taken for the binary log
+ */
+typedef struct {
+    _Atomic uint64_t sequence;
+    int64_t time_ns;
+    int id;
+    unsigned char type;
+    unsigned char event;
+    unsigned short service;
+} LogRecord;
+
+// Number of records in the log ring buffer (power of two)
+#define LOG_RING_SIZE 16384
+
+// Bit of log_head saying the post office is closed for new arrivals
+#define LOG_CLOSED_BIT (UINT64_C(1) << 63)
+
+// Maximum number of customers an officer takes from a queue at once (--batch)
+#define MAX_BATCH 64
+
+// Default number of services (letters, packages, money) and the maximum (--services)
+#define DEFAULT_SERVICE_TYPES 3
+#define MAX_SERVICE_TYPES 1024
+
+// Every power of two of a histogram is split into 2^HIST_SUB_BITS buckets
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/*
+ *  Structure: Histogram
+ *  --------------------
+ *  Log-bucketed histogram of times in nanoseconds,
+ *  the relative error of a bucket is below 1/HIST_SUB
+ */
+typedef struct {
+    _Atomic uint64_t counts[HIST_BUCKETS];
+    _Atomic uint64_t total;
+    _Atomic int64_t sum;
+    _Atomic int64_t max;
+} Histogram;
+
+/*
+ *  Structure: Lane
+ *  ---------------
+ *  FIFO queue of customer slots waiting for one service,
+ *  a ring of capacity ids, ids[head..tail) are guarded
+ *  by sem_lane, length can be read without it
+ *  Every lane has its own cache line with its lock
+ */
+typedef struct {
+    _Alignas(CACHE_LINE) sem_t sem_lane;
+    int head;
+    int tail;
+    int capacity;
+    _Atomic int length;
+    // Time the first customer in the queue entered, INT64_MAX if empty
+    _Atomic int64_t head_enter_ns;
+    int *ids;
+} Lane;
+
+/*
+ *  Structure: LaneSet
+ *  ------------------
+ *  Queues of all services, bit i of the bitmap
+ *  is set while the queue of service i + 1 is not empty
+ */
+typedef struct {
+    int count;
+    Lane *lanes;
+    _Atomic uint64_t *bitmap;
+} LaneSet;
+
+/*
+ *  Structure: Scheduler
+ *  --------------------
+ *  Policy of an officer choosing the next queue
+ *  pick() returns a service (1..count) with a non-empty queue,
+ *  0 if all are empty, next_lane is private to the officer
+ */
+typedef struct {
+    const char *name;
+    int (*pick)(LaneSet *set, Rng *rng, int *next_lane);
+} Scheduler;
+
+/*
+ *  Structure: CustomerSlot
+ *  -----------------------
+ *  Handshake of one customer with the officer serving it,
+ *  neighbouring customers do not share a cache line
+ */
+struct Fiber;
+
+typedef struct {
+    _Alignas(CACHE_LINE) sem_t sem_called;
+    sem_t sem_calling_before_done;
+    int64_t enter_ns;
+    // Fiber of the customer waiting to be called (--fibers), woken by the officer
+    _Atomic(struct Fiber *) parked;
+} CustomerSlot;
+
+/*
+ *  Structure: CpuStats
+ *  -------------------
+ *  Customers served by the officers running on one CPU
+ */
+typedef struct {
+    _Alignas(CACHE_LINE) _Atomic uint64_t served;
+} CpuStats;
+
 /*
  *  Structure: Shared_memory
  *  ------------------------
  *  Store data about the shared memory 
+ *  Customer slots, lanes, histograms and lane queues
+ *  follow the structure (see shared_mem_layout)
+ *  Counters written by many workers have a cache line each
  */
 typedef struct{
-    bool open;
-    int cislo_vypisu;
-    int num_letters;
-    int num_packages;
-    int num_money;
-    sem_t sem_writing;
-    sem_t sem_post_office;
-    sem_t sem_letters;
-    sem_t sem_packages;
-    sem_t sem_money;
-    sem_t sem_uradnik;
-    sem_t sem_calling_before_done; 
+    // Next line number, the closed flag is kept in the same word,
+    // so closing and entering the office are ordered like the lines
+    _Alignas(CACHE_LINE) _Atomic uint64_t log_head;
+    // Customers entering or waiting in a queue, not called yet
+    _Alignas(CACHE_LINE) _Atomic int waiting;
+    _Alignas(CACHE_LINE) sem_t sem_work;
+    // Latch of the closing (see wait_closed_until)
+    sem_t sem_closed;
+    // Pool of free customer slots of the streaming mode (--rate),
+    // sem_free counts them, sem_pool guards the stack
+    _Alignas(CACHE_LINE) sem_t sem_free;
+    sem_t sem_pool;
+    int free_top;
+    // Written rarely, log_abort asks the writer for the lines published so far,
+    // it sets log_flushed once the lines are written
+    _Alignas(CACHE_LINE) _Atomic bool log_stop;
+    _Atomic bool log_abort;
+    _Atomic bool log_flushed;
+    // Workers that started their role and the time the last one did
+    _Atomic int started;
+    _Atomic int64_t last_start_ns;
+    // Write calls and idle sleeps of the log writer, only the writer writes them
+    _Alignas(CACHE_LINE) uint64_t log_writes;
+    uint64_t log_sleeps;
+    // Pointers into the rest of the memory, read only
+    _Alignas(CACHE_LINE) LaneSet queues;
+    CustomerSlot *slots;
+    int *free_slots;
+    // Officers asked by the autoscaler to go home
+    _Atomic bool *retire;
+    // Live statistics (proj2.h), the officers and lanes of the block
+    StatsBlock *stats;
+    OfficerStats *officers;
+    LaneStats *lane_stats;
+    // Time in a queue and time of the service for every service
+    Histogram *wait_hist;
+    Histogram *service_hist;
+    // Served customers by the CPU of the officer
+    CpuStats *cpu_served;
+    _Alignas(CACHE_LINE) LogRecord log_ring[LOG_RING_SIZE];
 }Shared_memory;
 
-// Identification key for allocation of the shared memory
-#define shared_memory_key 1337
+// Maximal number of log lines the writer formats per batch
+#define LOG_BATCH 1024
+
+// Sleep of the log writer when there is nothing to write, doubled
+// up to the longest one while there is still nothing
+#define LOG_WRITER_IDLE_US 100
+#define LOG_WRITER_MAX_IDLE_US 2000
+
+// Buffer of the log writer (--log-buffer) and the longest time
+// a line may stay in it (--log-flush-ms)
+#define LOG_BUFFER_DEFAULT (1024 * 1024)
+#define LOG_BUFFER_MAX (1024 * 1024 * 1024)
+#define LOG_FLUSH_MS_DEFAULT 100
+
+// Longest wait of a killed or failing main for the last lines of the writer
+#define LOG_FINAL_FLUSH_MS 2000
+
+// Stack size of a worker thread in the threaded mode
+#define THREAD_STACK_SIZE (64 * 1024)
+
+// Most worker threads of the customer fibers (--fibers) and the stack of one fiber
+#define MAX_FIBER_WORKERS 1024
+#define FIBER_STACK_SIZE (16 * 1024)
+
+// Due timers a fiber worker takes before running the ready fibers
+#define FIBER_BATCH 256
+
+// Most officers the autoscaler may start (--max-officers), the scaling
+// lines keep the count in the 16 bit service of the log records
+#define MAX_OFFICERS UINT16_MAX
+
+// Limits of the streaming mode, customers per second and milliseconds
+#define MAX_STREAM_RATE 1000000
+#define MAX_STREAM_DURATION 3600000
+
+/*
+ *  Structure: Report
+ *  -----------------
+ *  Results of one run written by --report
+ */
+typedef struct {
+    const char *mode;
+    const char *policy;
+    int services;
+    int batch;
+    int NZ, NU, TZ, TU, F;
+    int64_t wall_ns;
+    int64_t startup_ns;
+    int served;
+    int turned_away;
+    uint64_t officer_served_min;
+    uint64_t officer_served_max;
+    uint64_t breaks;
+    // Officers allowed by the autoscaler, the most working at once
+    // and the time officers spent at work summed over the officers
+    int max_officers;
+    int officer_peak;
+    int64_t officer_ns;
+    // Streaming mode, all zero in the closed simulation
+    double rate;
+    int arrivals;
+    int rejected;
+    double queue_growth_per_s;
+    bool stable;
+    // Seed of the random numbers (--seed)
+    uint64_t seed;
+    // Placement of the officers and customers, their CPUs and
+    // the customers served on every CPU as cpu:served joined by ;
+    const char *placement;
+    char officer_cpu_list[256];
+    char customer_cpu_list[256];
+    int cpus_used;
+    char *cpu_served;
+    // Write calls and idle sleeps of the log writer
+    uint64_t log_writes;
+    uint64_t log_sleeps;
+    // Waiting times of the served customers in all queues
+    Histogram wait;
+} Report;
+
+/*
+ *  Structure: WorkerArgs
+ *  ---------------------
+ *  Arguments handed over to a worker thread
+ */
+typedef struct {
+    ProcessInfo process_info;
+    int time_limit;
+    Shared_memory *shm;
+    // Started after the startup (autoscaler, stream), not counted in the startup time
+    bool late;
+} WorkerArgs;
+
+/*
+ *  Structure: LogWriterArgs
+ *  ------------------------
+ *  Arguments handed over to the log writer thread
+ */
+typedef struct {
+    Shared_memory *shm;
+    FILE *f;
+    char *buf;
+} LogWriterArgs;
+
+// Number of services (--services)
+static int service_types = DEFAULT_SERVICE_TYPES;
+
+// Number of customers an officer takes from a queue at once (--batch)
+static int batch_size = 1;
+
+// Scheduler of the officers (--policy) and weights of services (--weights)
+static const Scheduler *scheduler;
+static int service_weights[MAX_SERVICE_TYPES];
+
+// Customers and officers run as threads of one process (--threads)
+static bool threads_mode = false;
+
+// Customers run as fibers on this many worker threads (--fibers, 0 without),
+// the officers as threads
+static int fiber_workers = 0;
+
+// Log records go to proj2.bin instead of lines to proj2.out (--binary-log),
+// their times are counted from log_start_ns
+static bool binary_log = false;
+static int64_t log_start_ns;
+
+// Buffer of the log writer in bytes (--log-buffer), the longest time
+// a line stays in it (--log-flush-ms) and the memory of the writer
+// for the final flush, NULL once the writer is done
+static size_t log_buffer_size = LOG_BUFFER_DEFAULT;
+static int log_flush_ms = LOG_FLUSH_MS_DEFAULT;
+static Shared_memory *log_shm = NULL;
+
+// Streaming mode, customers per second (--rate, 0 for the closed simulation),
+// how long they arrive (--duration) and how (--arrivals)
+typedef enum {
+    ARRIVALS_POISSON,
+    ARRIVALS_BURSTY
+} Arrivals;
+static double stream_rate = 0;
+static int stream_duration_ms = -1;
+static Arrivals stream_arrivals = ARRIVALS_POISSON;
+
+// Customer threads of the stream that are done, each counts itself
+// after its last touch of its WorkerArgs and the shared memory
+static _Atomic int stream_threads_done = 0;
+
+// Officers the autoscaler may have at work (--max-officers, 0 for N_OFF), it adds one
+// above scale_depth waiting customers per officer (--scale-depth) or when a customer
+// waits longer than scale_wait_ms (--scale-wait, 0 to not look at the wait),
+// the officers above min_officers (N_OFF) may be sent home while the post is open
+static int max_officers = 0;
+static int min_officers = 0;
+static int scale_depth = 4;
+static int scale_wait_ms = 10;
+
+// CPUs of the officers ordered by node, one each (--officer-cpus), the CPUs
+// of the customers (--customer-cpus) and the name of the placement in the report
+static int *officer_cpus = NULL;
+static int num_officer_cpus = 0;
+static cpu_set_t officer_cpu_set;
+static cpu_set_t customer_cpus;
+static bool customers_pinned = false;
+static const char *placement = "none";
+
+// CPUs counted in the served customers per CPU
+static int num_cpus = 1;
+
+// Name of the live statistics, empty if there are none, and the process removing them
+static char stats_name[STATS_NAME_MAX];
+static pid_t stats_owner;
+
+void *worker_thread(void *arg);
+void log_final_flush(void);
 
 /*
  *  Funtion: check_time_range_included
@@ -80,467 +461,3963 @@ void not_number_input(char *str)
 }
 
 /*
- *  Funtion: destroy_shared_mem
- *  ---------------------------
- *  Detachment and deletion of the shared memory 
+ *  Funtion: now_ns
+ *  ---------------
+ *  Returns: monotonic time in nanoseconds, comparable between processes
  */
-void destroy_shared_mem(int shmid, Shared_memory *shm) {
-    // The function detaches the shared memory segment
-    if (shmdt(shm) == -1) {
-        fprintf(stderr, "Error: Failed to detach shared memory.\n");
-        exit(EXIT_FAILURE);
+int64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ *  Funtion: hist_index
+ *  -------------------
+ *  Returns: bucket of a histogram for the value
+ */
+int hist_index(int64_t value)
+{
+    if (value < HIST_SUB) return value < 0 ? 0 : (int)value;
+
+    int exponent = 63 - __builtin_clzll((uint64_t)value);
+    int sub = (int)((value >> (exponent - HIST_SUB_BITS)) & (HIST_SUB - 1));
+    return (exponent - HIST_SUB_BITS + 1) * HIST_SUB + sub;
+}
+
+/*
+ *  Funtion: hist_bucket_low
+ *  ------------------------
+ *  Returns: the lowest value falling into the bucket
+ */
+int64_t hist_bucket_low(int index)
+{
+    if (index < HIST_SUB) return index;
+
+    int exponent = index / HIST_SUB + HIST_SUB_BITS - 1;
+    return (int64_t)(HIST_SUB + index % HIST_SUB) << (exponent - HIST_SUB_BITS);
+}
+
+/*
+ *  Funtion: hist_record
+ *  --------------------
+ *  Adds a value to a histogram, safe for concurrent callers
+ */
+void hist_record(Histogram *h, int64_t value)
+{
+    atomic_fetch_add_explicit(&h->counts[hist_index(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->total, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, value, memory_order_relaxed);
+
+    int64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while (value > max && !atomic_compare_exchange_weak(&h->max, &max, value));
+}
+
+/*
+ *  Funtion: hist_merge
+ *  -------------------
+ *  Adds all values of the histogram src to dst
+ */
+void hist_merge(Histogram *dst, Histogram *src)
+{
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        atomic_fetch_add(&dst->counts[i], atomic_load(&src->counts[i]));
     }
+    atomic_fetch_add(&dst->total, atomic_load(&src->total));
+    atomic_fetch_add(&dst->sum, atomic_load(&src->sum));
+    if (atomic_load(&src->max) > atomic_load(&dst->max)) atomic_store(&dst->max, atomic_load(&src->max));
+}
 
-    // The function removes the shared memory segment from the system
-    if (shmctl(shmid, IPC_RMID, NULL) == -1) {
-        fprintf(stderr, "Error: Failed to remove shared memory.\n");
-        exit(EXIT_FAILURE);
+/*
+ *  Funtion: hist_percentile
+ *  ------------------------
+ *  Returns: the highest value of the bucket holding the percentile
+ */
+int64_t hist_percentile(Histogram *h, double p)
+{
+    uint64_t total = atomic_load(&h->total);
+    if (total == 0) return 0;
+
+    uint64_t rank = (uint64_t)(p / 100.0 * total + 0.5);
+    if (rank < 1) rank = 1;
+
+    uint64_t count = 0;
+    int64_t max = atomic_load(&h->max);
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        count += atomic_load(&h->counts[i]);
+        if (count >= rank) {
+            int64_t high = hist_bucket_low(i + 1) - 1;
+            return high < max ? high : max;
+        }
     }
+    return max;
 }
 
+/*
+ *  Funtion: print_histogram
+ *  ------------------------
+ *  Prints a summary and the non-empty buckets in microseconds
+ */
+void print_histogram(FILE *out, const char *name, int type_service, Histogram *h)
+{
+    uint64_t total = atomic_load(&h->total);
+
+    fprintf(out, "%s %d: count %" PRIu64 " mean %.1f p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f us\n",
+            name, type_service, total, total ? atomic_load(&h->sum) / 1e3 / total : 0.0,
+            hist_percentile(h, 50) / 1e3, hist_percentile(h, 90) / 1e3, hist_percentile(h, 99) / 1e3,
+            hist_percentile(h, 99.9) / 1e3, atomic_load(&h->max) / 1e3);
+
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        uint64_t count = atomic_load(&h->counts[i]);
+        if (count == 0) continue;
+        fprintf(out, "    [%12.3f, %12.3f) %10" PRIu64 "\n", hist_bucket_low(i) / 1e3, hist_bucket_low(i + 1) / 1e3, count);
+    }
+}
 
 /*
- *  Funtion: create_processes
+ *  Funtion: write_histograms
  *  -------------------------
- *  Creates all child processes 
- *  Takes the total number of processes
- *  and firstly creates officers, then customers
+ *  Writes the waiting and service time histograms of all services
+ *  into the file, stderr if path is "-"
+ *  Returns: 0 (if the histograms were written)
+ *           else (not)
  */
-void create_processes(int num_zakaznik, int num_uradnik, ProcessInfo* process_info) {
-    for (int i = 1; i <= num_zakaznik + num_uradnik; i++) {
-        pid_t pid = fork();
-        if (pid == -1) {
-            fprintf(stderr, "Failed to create child process %d\n", i);
-            exit(1);
-        } else if (pid == 0) {
-            // This is the child process
-            if (i <= num_uradnik) {
-                process_info->type = URADNIK;
-                process_info->id = i;
-            } else {
-                process_info->type = ZAKAZNIK;
-                process_info->id = i - num_uradnik;
-            }
-            return;
-        }
+int write_histograms(const char *path, Histogram *wait_hist, Histogram *service_hist)
+{
+    FILE *out = strcmp(path, "-") == 0 ? stderr : fopen(path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Error: Failed to open the histogram file %s\n", path);
+        return 1;
+    }
+
+    for (int i = 0; i < service_types; i++) {
+        print_histogram(out, "wait for service", i + 1, &wait_hist[i]);
+    }
+    for (int i = 0; i < service_types; i++) {
+        print_histogram(out, "duration of service", i + 1, &service_hist[i]);
     }
+
+    if (out != stderr && fclose(out) == EOF) {
+        fprintf(stderr, "Error: Failed to write the histogram file %s\n", path);
+        return 1;
+    }
+    return 0;
 }
 
 /*
- *  Function: sem_inicialization
- *  ----------------------------
- *  Provides inicialization of semaphores
- *  Returns: 0 (if the initialization took place correctly)
- *           else (not) 
+ *  Funtion: write_report
+ *  ---------------------
+ *  Writes the results of the run as a CSV header and row
+ *  Returns: 0 (if the report was written)
+ *           else (not)
  */
-int sem_inicialization(sem_t *sem, int init_value)
+int write_report(const char *path, Report *r)
 {
-	if (sem_init(sem, 1, init_value) == -1)
-	{
-		fprintf(stderr, "%s\n", "Error: Sem_init failed.");
-		return 1;
-	}
-	return 0;
+    FILE *rf = fopen(path, "w");
+    if (rf == NULL) {
+        fprintf(stderr, "Error: Failed to open the report file %s\n", path);
+        return 1;
+    }
+
+    double wall_s = r->wall_ns / 1e9;
+
+    fprintf(rf, "mode,policy,services,batch,n_cus,n_off,t_cus,t_off,f,wall_ms,startup_ms,served,turned_away,served_per_sec,wait_p50_us,wait_p99_us,officer_served_min,officer_served_max,breaks,max_officers,officer_peak,served_per_officer_sec,rate,arrivals,rejected,queue_growth_per_s,stable,seed,placement,officer_cpus,customer_cpus,cpus_used,cpu_served,log_writes,log_sleeps\n");
+    fprintf(rf, "%s,%s,%d,%d,%d,%d,%d,%d,%d,%.3f,%.3f,%d,%d,%.1f,%.1f,%.1f,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%d,%d,%.1f,%.1f,%d,%d,%.2f,%d,%" PRIu64 ",%s,%s,%s,%d,%s,%" PRIu64 ",%" PRIu64 "\n",
+            r->mode, r->policy, r->services, r->batch, r->NZ, r->NU, r->TZ, r->TU, r->F, r->wall_ns / 1e6, r->startup_ns / 1e6,
+            r->served, r->turned_away, wall_s > 0 ? r->served / wall_s : 0.0,
+            hist_percentile(&r->wait, 50) / 1e3, hist_percentile(&r->wait, 99) / 1e3,
+            r->officer_served_min, r->officer_served_max, r->breaks,
+            r->max_officers, r->officer_peak, r->officer_ns > 0 ? r->served / (r->officer_ns / 1e9) : 0.0,
+            r->rate, r->arrivals, r->rejected, r->queue_growth_per_s, r->stable, r->seed, r->placement,
+            r->officer_cpu_list, r->customer_cpu_list, r->cpus_used, r->cpu_served != NULL ? r->cpu_served : "",
+            r->log_writes, r->log_sleeps);
+
+    if (fclose(rf) == EOF) {
+        fprintf(stderr, "Error: Failed to write the report file %s\n", path);
+        return 1;
+    }
+    return 0;
 }
 
 /*
- *  Function: write_log
- *  -------------------
- *  Writes processes log messages
+ *  Funtion: write_results
+ *  ----------------------
+ *  Completes the report from the histograms and officer statistics of the run
+ *  and writes the files requested on the command line
+ *  Returns: 0 (if everything was written)
+ *           else (not)
  */
-void write_log(Shared_memory *shm, char* name, ProcessInfo* process_info, char* state, FILE* f)
-{   
-    sem_wait(&shm->sem_writing);
-    fprintf(f,"%d: %s %d: %s\n", shm->cislo_vypisu, name, process_info->id, state);
-    fflush(f);
-    shm->cislo_vypisu++;
-    sem_post(&shm->sem_writing);
+int write_results(Report *report, const char *report_path, const char *hist_path,
+                  Histogram *wait_hist, Histogram *service_hist, OfficerStats *officers)
+{
+    int result = 0;
+
+    // Officers the autoscaler never started do not count
+    for (int i = 0; i < report->max_officers; i++) {
+        if (i >= report->NU && atomic_load(&officers[i].state) == OFFICER_STARTING) continue;
+        uint64_t served = atomic_load(&officers[i].served);
+        if (i == 0 || served < report->officer_served_min) report->officer_served_min = served;
+        if (served > report->officer_served_max) report->officer_served_max = served;
+        report->breaks += atomic_load(&officers[i].breaks);
+    }
+
+    for (int i = 0; i < service_types; i++) {
+        hist_merge(&report->wait, &wait_hist[i]);
+    }
+    report->served = (int)atomic_load(&report->wait.total);
+
+    if (report_path != NULL && write_report(report_path, report) != 0) result = 1;
+    if (hist_path != NULL && write_histograms(hist_path, wait_hist, service_hist) != 0) result = 1;
+    return result;
 }
 
 /*
- *  Funtion: exit_closed_entrance
- *  -----------------------------
- *  Customer checks if post office is open
- *  while entering it
- *  Going home if it is closed 
+ *  Funtion: cache_line_round
+ *  -------------------------
+ *  Returns: size rounded up to whole cache lines
  */
-void exit_closed_entrance(Shared_memory *shm, ProcessInfo* process_info, FILE* f)
+size_t cache_line_round(size_t size)
 {
-    if(shm->open == false)
-    {   
-        fprintf(f,"%d: Z %d: going home\n", shm->cislo_vypisu, process_info->id);
-        fflush(f);
-        shm->cislo_vypisu++;
-        sem_post(&shm->sem_writing);
-        sem_post(&shm->sem_post_office);
-        exit(0);
-    }
+    return (size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
 }
 
 /*
- *  Funtion: officer_wait_before_task_done()
- *  -----------------------------
- *  Officer doing task, unsleep <0,10>
+ *  Funtion: aligned_calloc
+ *  -----------------------
+ *  Zeroed memory starting on a cache line
+ *  Returns: the memory, NULL if the allocation failed
  */
-void officer_wait_before_task_done()
+void *aligned_calloc(size_t count, size_t size)
 {
-    srand(time(NULL) *getpid());
-    int officer_wait = rand() % 11;
-    usleep(officer_wait);
+    size_t bytes = cache_line_round(count * size);
+    void *memory = aligned_alloc(CACHE_LINE, bytes > 0 ? bytes : CACHE_LINE);
+
+    if (memory != NULL) memset(memory, 0, bytes);
+    return memory;
 }
 
 /*
- *  Function: customer
- *  ------------------
- *  Life cycle of a custumer
- *  Provides synchronization between processes
+ *  Funtion: shared_mem_layout
+ *  --------------------------
+ *  Size of the shared memory including the customer slots, lanes,
+ *  lane bitmap, histograms, the pool of free slots, retire flags and the queues
+ *  for the given number of customers, officers and services, every part starts on a cache line,
+ *  sets the pointers if shm is not NULL
  */
-void customer(ProcessInfo* process_info,int TZ, Shared_memory *shm, FILE* f)
-{   
-    // Random time before entering the Post office
-    srand(time(NULL) *getpid());
-    int time_zakaznik = rand() % (TZ + 1);
-    usleep(time_zakaznik * 1000);
+size_t shared_mem_layout(Shared_memory *shm, int num_zakaznik, int num_uradnik, int num_services)
+{
+    size_t bitmap_words = (num_services + 63) / 64;
+    size_t size = sizeof(Shared_memory);
 
-    write_log(shm, "Z", process_info, "started", f);
+    size_t slots = size;
+    size += num_zakaznik * sizeof(CustomerSlot);
+    size_t lanes = size;
+    size += num_services * sizeof(Lane);
+    size_t bitmap = size;
+    size += cache_line_round(bitmap_words * sizeof(uint64_t));
+    size_t hists = size;
+    size += cache_line_round(2 * num_services * sizeof(Histogram));
+    size_t free_slots = size;
+    size += cache_line_round(num_zakaznik * sizeof(int));
+    size_t retire = size;
+    size += cache_line_round(num_uradnik * sizeof(_Atomic bool));
+    size_t ids = size;
+    size += cache_line_round((size_t)num_services * (num_zakaznik + 1) * sizeof(int));
+    size_t cpus = size;
+    size += num_cpus * sizeof(CpuStats);
 
-    if(shm->open == false)
-    {   
-        write_log(shm, "Z", process_info, "going home", f);
-        exit(0);
+    if (shm != NULL) {
+        char *base = (char *)shm;
+        shm->slots = (CustomerSlot *)(base + slots);
+        shm->queues.count = num_services;
+        shm->queues.lanes = (Lane *)(base + lanes);
+        shm->queues.bitmap = (_Atomic uint64_t *)(base + bitmap);
+        shm->wait_hist = (Histogram *)(base + hists);
+        shm->service_hist = shm->wait_hist + num_services;
+        shm->free_slots = (int *)(base + free_slots);
+        shm->retire = (_Atomic bool *)(base + retire);
+        shm->cpu_served = (CpuStats *)(base + cpus);
+        for (int i = 0; i < num_services; i++) {
+            shm->queues.lanes[i].ids = (int *)(base + ids) + (size_t)i * (num_zakaznik + 1);
+            shm->queues.lanes[i].capacity = num_zakaznik + 1;
+        }
+    }
+    return size;
+}
+
+/*
+ *  Funtion: create_shared_mem
+ *  --------------------------
+ *  Anonymous shared memory of the run, inherited by the forked
+ *  processes and gone with the last of them, so parallel runs
+ *  do not meet and a crashed run leaves nothing behind
+ *  Returns: the memory, NULL if it could not be mapped
+ */
+Shared_memory *create_shared_mem(size_t size)
+{
+    Shared_memory *shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    return shm == MAP_FAILED ? NULL : shm;
+}
+
+/*
+ *  Funtion: destroy_shared_mem
+ *  ---------------------------
+ *  Detachment of the shared memory 
+ */
+void destroy_shared_mem(Shared_memory *shm, size_t size) {
+    if (munmap(shm, size) == -1) {
+        fprintf(stderr, "Error: Failed to detach shared memory.\n");
+        exit(EXIT_FAILURE);
     }
+}
 
-    sem_wait(&shm->sem_post_office);
 
-    // Chooses random servise at post office
-    int type_service = (random() % 3) + 1;
-    switch(type_service)
-	{
-		case 1:  
-            sem_wait(&shm->sem_writing);
+/*
+ *  Funtion: stats_create
+ *  ---------------------
+ *  Creates the live statistics /proj2-stats.<pid> read by proj2-stat,
+ *  anonymous shared memory if it cannot be created
+ *  Returns: the statistics, NULL if no memory could be mapped
+ */
+StatsBlock *stats_create(int num_zakaznik, int num_uradnik, int num_services, int64_t start_ns)
+{
+    char *name = stats_name;
+    size_t officers = cache_line_round(sizeof(StatsBlock));
+    size_t lanes = officers + num_uradnik * sizeof(OfficerStats);
+    size_t size = lanes + num_services * sizeof(LaneStats);
+    StatsBlock *stats = MAP_FAILED;
+
+    stats_owner = getpid();
+    snprintf(name, STATS_NAME_MAX, STATS_NAME_FORMAT, (int)stats_owner);
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd != -1) {
+        if (ftruncate(fd, size) == 0) {
+            stats = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (stats == MAP_FAILED) shm_unlink(name);
+    }
+    if (stats == MAP_FAILED) {
+        fprintf(stderr, "Warning: Failed to create the statistics %s, proj2-stat will not see the run\n", name);
+        name[0] = '\0';
+        stats = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (stats == MAP_FAILED) return NULL;
+    }
 
-            exit_closed_entrance(shm, process_info, f);
-            
-            // Enter post office if not closed
-            shm->num_letters++;
-            fprintf(f, "%d: Z %d: entering office for a service %d\n", shm->cislo_vypisu, process_info->id, type_service);
-            fflush(f);
-            shm->cislo_vypisu++;
+    // Fresh mappings are zeroed
+    stats->version = STATS_VERSION;
+    stats->pid = getpid();
+    stats->size = size;
+    stats->num_customers = num_zakaznik;
+    stats->num_officers = num_uradnik;
+    stats->num_services = num_services;
+    stats->start_ns = start_ns;
+    stats->officers_offset = officers;
+    stats->lanes_offset = lanes;
+    atomic_store(&stats->magic, STATS_MAGIC);
+    return stats;
+}
 
-            sem_post(&shm->sem_writing);
+/*
+ *  Funtion: stats_destroy
+ *  ----------------------
+ *  Marks the run as finished for attached readers,
+ *  unmaps and removes the statistics
+ */
+void stats_destroy(StatsBlock *stats)
+{
+    atomic_store(&stats->finished, true);
+    munmap(stats, stats->size);
+    if (stats_name[0] != '\0') shm_unlink(stats_name);
+    stats_name[0] = '\0';
+}
 
-            sem_post(&shm->sem_post_office);
+/*
+ *  Funtion: stats_signal_cleanup
+ *  -----------------------------
+ *  Removes the statistics when the main process is killed and lets
+ *  the log writer write its lines, then dies of the signal as it would
+ *  without the handler, a crash (SIGSEGV, SIGBUS, SIGABRT) dies at once
+ */
+void stats_signal_cleanup(int sig)
+{
+    if (sig == SIGINT || sig == SIGTERM || sig == SIGHUP || sig == SIGQUIT) log_final_flush();
+    if (getpid() == stats_owner && stats_name[0] != '\0') shm_unlink(stats_name);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
 
-            // Give signal that someone is waiting in the queue with letters
-            sem_wait(&shm->sem_letters);
+/*
+ *  Funtion: stats_remove_stale
+ *  ---------------------------
+ *  Removes statistics left behind by runs killed by SIGKILL
+ */
+void stats_remove_stale(void)
+{
+    DIR *dir = opendir("/dev/shm");
+    if (dir == NULL) return;
 
-            write_log(shm, "Z", process_info, "called by office worker", f);
-            // Synchronization called by office worker and service finished          
-            sem_post(&shm->sem_calling_before_done);
-			break;
-		case 2:  
-            sem_wait(&shm->sem_writing);
+    const char *prefix = STATS_NAME_FORMAT + 1;
+    size_t prefix_len = strchr(prefix, '%') - prefix;
+    struct dirent *entry;
 
-            exit_closed_entrance(shm, process_info, f);
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, prefix, prefix_len) != 0) continue;
 
-            // Enter post office if not closed
-            shm->num_packages++;
-            fprintf(f, "%d: Z %d: entering office for a service %d\n", shm->cislo_vypisu, process_info->id, type_service);
-            fflush(f);
-            shm->cislo_vypisu++;
+        char *end;
+        long pid = strtol(entry->d_name + prefix_len, &end, 10);
+        if (*end != '\0' || pid <= 0) continue;
 
-            sem_post(&shm->sem_writing);
+        if (kill(pid, 0) == -1 && errno == ESRCH) {
+            char name[STATS_NAME_MAX + 256];
+            snprintf(name, sizeof(name), "/%s", entry->d_name);
+            shm_unlink(name);
+        }
+    }
+    closedir(dir);
+}
 
-            sem_post(&shm->sem_post_office);
+/*
+ *  Funtion: die_with_parent
+ *  ------------------------
+ *  A forked process is killed when the process that forked it dies,
+ *  so a crash of the main process takes down the whole run
+ */
+void die_with_parent(pid_t parent)
+{
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (getppid() != parent) _exit(1);
+}
 
-            // Give signal that someone is waiting in the queue with packages
-            sem_wait(&shm->sem_packages);
+/*
+ *  Funtion: mark_started
+ *  ---------------------
+ *  Worker records that it has been started
+ */
+void mark_started(Shared_memory *shm)
+{
+    int64_t now = now_ns();
+    int64_t last = atomic_load(&shm->last_start_ns);
 
-            write_log(shm, "Z", process_info, "called by office worker", f);
-            // Synchronization called by office worker and service finished
-            sem_post(&shm->sem_calling_before_done);
-			break;
-        case 3:  
-            sem_wait(&shm->sem_writing);
+    atomic_fetch_add(&shm->started, 1);
+    while (last < now && !atomic_compare_exchange_weak(&shm->last_start_ns, &last, now));
+}
+
+/*
+ *  ________PLACEMENT__________
+ *  Officers pinned one to a CPU of --officer-cpus, customers kept on the
+ *  CPUs of --customer-cpus, --numa derives the sets the options do not give
+ *  from the NUMA nodes and puts the shared memory on the node of the officers
+ */
+
+/*
+ *  Funtion: cpu_node
+ *  -----------------
+ *  Returns: NUMA node of the cpu, 0 if the kernel does not tell
+ */
+int cpu_node(int cpu)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if (dir == NULL) return 0;
+
+    int node = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char *end;
+        if (strncmp(entry->d_name, "node", 4) != 0) continue;
+        long n = strtol(entry->d_name + 4, &end, 10);
+        if (*end == '\0' && end != entry->d_name + 4) {
+            node = (int)n;
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+/*
+ *  Funtion: parse_cpu_list
+ *  -----------------------
+ *  Adds the CPUs of a list like 0-3,8 to the set, an entry nodeN
+ *  stands for the CPUs of the NUMA node N
+ *  Returns: 0 (if the list is valid)
+ *           else (not)
+ */
+int parse_cpu_list(const char *list, cpu_set_t *set)
+{
+    char *copy = strdup(list);
+    if (copy == NULL) return 1;
+
+    int result = 0;
+    for (char *save = NULL, *entry = strtok_r(copy, ",\n", &save); entry != NULL && result == 0;
+         entry = strtok_r(NULL, ",\n", &save))
+    {
+        char *end;
+        if (strncmp(entry, "node", 4) == 0) {
+            char path[64];
+            char cpus[4096];
+            long node = strtol(entry + 4, &end, 10);
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%ld/cpulist", node);
+            FILE *nf = *end == '\0' && end != entry + 4 ? fopen(path, "r") : NULL;
+            if (nf == NULL) {
+                result = 1;
+                break;
+            }
+            if (fgets(cpus, sizeof(cpus), nf) == NULL) cpus[0] = '\0';
+            fclose(nf);
+            // A node without CPUs has an empty list
+            if (cpus[0] != '\n' && cpus[0] != '\0') result = parse_cpu_list(cpus, set);
+            continue;
+        }
+
+        long first = strtol(entry, &end, 10);
+        long last = first;
+        if (end == entry) result = 1;
+        else if (*end == '-') last = strtol(end + 1, &end, 10);
+        if (*end != '\0' || first < 0 || last < first || last >= CPU_SETSIZE) result = 1;
+        for (long cpu = first; result == 0 && cpu <= last; cpu++) {
+            CPU_SET(cpu, set);
+        }
+    }
+    free(copy);
+    return result;
+}
+
+/*
+ *  Funtion: format_cpu_list
+ *  ------------------------
+ *  Writes the set as ranges joined by +, so it fits a column of the report
+ */
+void format_cpu_list(const cpu_set_t *set, char *buf, size_t size)
+{
+    size_t len = 0;
+    buf[0] = '\0';
+    for (int cpu = 0; cpu < CPU_SETSIZE && len < size; cpu++) {
+        if (!CPU_ISSET(cpu, set)) continue;
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set)) last++;
+        if (last == cpu) len += snprintf(buf + len, size - len, len > 0 ? "+%d" : "%d", cpu);
+        else len += snprintf(buf + len, size - len, len > 0 ? "+%d-%d" : "%d-%d", cpu, last);
+        cpu = last;
+    }
+}
+
+/*
+ *  Funtion: placement_setup
+ *  ------------------------
+ *  Builds the CPU sets of the officers and customers from the lists
+ *  (NULL if not given), with numa the missing ones from the nodes: officers
+ *  on the node of the first usable CPU, customers on the other nodes, one node
+ *  is split in halves, the officer CPUs are ordered by node so the officers
+ *  fill a node before the next one
+ *  Returns: 0 (if the sets are usable)
+ *           else (not)
+ */
+int placement_setup(const char *officer_list, const char *customer_list, bool numa)
+{
+    cpu_set_t allowed, officers, customers;
+    CPU_ZERO(&officers);
+    CPU_ZERO(&customers);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+        fprintf(stderr, "Error: Failed to read the CPUs of the process\n");
+        return 1;
+    }
+
+    if (officer_list != NULL && parse_cpu_list(officer_list, &officers) != 0) {
+        fprintf(stderr, "Invalid CPU list %s (e.g. 0-3,8 or node1)\n", officer_list);
+        return 1;
+    }
+    if (customer_list != NULL && parse_cpu_list(customer_list, &customers) != 0) {
+        fprintf(stderr, "Invalid CPU list %s (e.g. 0-3,8 or node1)\n", customer_list);
+        return 1;
+    }
+
+    if (numa && (officer_list == NULL || customer_list == NULL))
+    {
+        int count = CPU_COUNT(&allowed);
+        int first_node = -1, taken = 0;
+        cpu_set_t node_cpus, other_cpus;
+        CPU_ZERO(&node_cpus);
+        CPU_ZERO(&other_cpus);
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (!CPU_ISSET(cpu, &allowed)) continue;
+            int node = cpu_node(cpu);
+            if (first_node == -1) first_node = node;
+            if (node == first_node) CPU_SET(cpu, &node_cpus);
+            else CPU_SET(cpu, &other_cpus);
+        }
+        if (CPU_COUNT(&other_cpus) == 0) {
+            CPU_ZERO(&node_cpus);
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (!CPU_ISSET(cpu, &allowed)) continue;
+                if (taken++ < (count + 1) / 2) CPU_SET(cpu, &node_cpus);
+                else CPU_SET(cpu, &other_cpus);
+            }
+        }
+
+        // The side given by an option gets the CPUs the other one does not use
+        if (officer_list == NULL && customer_list == NULL) {
+            officers = node_cpus;
+            customers = CPU_COUNT(&other_cpus) > 0 ? other_cpus : allowed;
+        } else if (officer_list == NULL) {
+            CPU_XOR(&officers, &allowed, &customers);
+            CPU_AND(&officers, &officers, &allowed);
+            if (CPU_COUNT(&officers) == 0) officers = allowed;
+        } else {
+            CPU_XOR(&customers, &allowed, &officers);
+            CPU_AND(&customers, &customers, &allowed);
+            if (CPU_COUNT(&customers) == 0) customers = allowed;
+        }
+    }
+
+    CPU_AND(&officers, &officers, &allowed);
+    CPU_AND(&customers, &customers, &allowed);
+    if ((officer_list != NULL || numa) && CPU_COUNT(&officers) == 0) {
+        fprintf(stderr, "Error: None of the officer CPUs can be used by the process\n");
+        return 1;
+    }
+    if ((customer_list != NULL || numa) && CPU_COUNT(&customers) == 0) {
+        fprintf(stderr, "Error: None of the customer CPUs can be used by the process\n");
+        return 1;
+    }
+
+    if (CPU_COUNT(&officers) > 0)
+    {
+        officer_cpus = malloc(CPU_COUNT(&officers) * sizeof(int));
+        if (officer_cpus == NULL) return 1;
+        officer_cpu_set = officers;
+
+        // Insertion by node, the CPUs of one node keep their order
+        int nodes[CPU_SETSIZE];
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (!CPU_ISSET(cpu, &officers)) continue;
+            int node = cpu_node(cpu);
+            int j = num_officer_cpus++;
+            for (; j > 0 && nodes[j - 1] > node; j--) {
+                officer_cpus[j] = officer_cpus[j - 1];
+                nodes[j] = nodes[j - 1];
+            }
+            officer_cpus[j] = cpu;
+            nodes[j] = node;
+        }
+    }
+    if (CPU_COUNT(&customers) > 0) {
+        customer_cpus = customers;
+        customers_pinned = true;
+    }
+    placement = numa ? "numa" : num_officer_cpus > 0 || customers_pinned ? "pinned" : "none";
+    return 0;
+}
+
+/*
+ *  Funtion: pin_officer
+ *  --------------------
+ *  Officer runs only on its CPU of --officer-cpus, officers
+ *  share the CPUs round robin when there are more of them
+ */
+void pin_officer(int id)
+{
+    if (num_officer_cpus == 0) return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(officer_cpus[(id - 1) % num_officer_cpus], &set);
+    if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+        fprintf(stderr, "Error: Failed to pin officer %d to CPU %d\n", id, officer_cpus[(id - 1) % num_officer_cpus]);
+    }
+}
+
+/*
+ *  Funtion: pin_main
+ *  -----------------
+ *  Moves the main thread onto the officer CPUs (officers true) while it
+ *  first touches the shared memory, or onto the customer CPUs the customers,
+ *  the log writer and the officers before pinning inherit from it
+ */
+void pin_main(bool officers, const cpu_set_t *allowed)
+{
+    const cpu_set_t *set = officers ? &officer_cpu_set : customers_pinned ? &customer_cpus : allowed;
+    if (officers && num_officer_cpus == 0) return;
+    if (sched_setaffinity(0, sizeof(cpu_set_t), set) == -1) {
+        fprintf(stderr, "Error: Failed to set the CPUs of the main process\n");
+    }
+}
+
+/*
+ *  Funtion: report_cpus
+ *  --------------------
+ *  Fills in the placement of the run and the customers served on every CPU
+ */
+void report_cpus(Report *r, CpuStats *cpu_served)
+{
+    r->placement = placement;
+    if (num_officer_cpus > 0) format_cpu_list(&officer_cpu_set, r->officer_cpu_list, sizeof(r->officer_cpu_list));
+    if (customers_pinned) format_cpu_list(&customer_cpus, r->customer_cpu_list, sizeof(r->customer_cpu_list));
+
+    r->cpu_served = malloc(num_cpus * 32 + 1);
+    if (r->cpu_served == NULL) return;
+    size_t len = 0;
+    r->cpu_served[0] = '\0';
+    for (int cpu = 0; cpu < num_cpus; cpu++) {
+        uint64_t served = atomic_load(&cpu_served[cpu].served);
+        if (served == 0) continue;
+        len += sprintf(r->cpu_served + len, len > 0 ? ";%d:%" PRIu64 : "%d:%" PRIu64, cpu, served);
+        r->cpus_used++;
+    }
+}
+
+/*
+ *  ________RANDOM NUMBERS AND REPLAY__________
+ *  Every worker draws from its own xoshiro256** generator seeded
+ *  from the seed of the run (--seed), its role and id, so the same
+ *  seed gives every worker the same numbers
+ *  --record writes the random decisions of the workers into a file,
+ *  --replay takes them back from it instead of the drawn ones
+ */
+
+// "PROJ2REC" and the version of the decision records
+#define RECORD_MAGIC "PROJ2REC"
+#define RECORD_VERSION 1
+
+// Decisions a worker keeps before writing them
+#define RECORD_BATCH 256
+
+#define DECISION_KINDS (DECISION_BURST + 1)
+
+/*
+ *  Structure: RecordHeader
+ *  -----------------------
+ *  Start of the file of --record, the decisions follow
+ *  as the workers write them, those of one worker in order
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t seed;
+} RecordHeader;
+
+/*
+ *  Structure: Replay
+ *  -----------------
+ *  Decisions of --replay sorted by role, id and kind, those of one kind
+ *  of the worker id are decisions[start[role][key]..start[role][key + 1])
+ *  for key = id * DECISION_KINDS + kind, next[role][key] is the next one
+ *  to take, so a worker missing a break does not shift its queues
+ *  Shared by the forked processes like the shared memory
+ */
+typedef struct {
+    _Atomic uint64_t divergences;
+    int num_keys[URADNIK + 1];
+    int *start[URADNIK + 1];
+    _Atomic int *next[URADNIK + 1];
+    Decision *decisions;
+} Replay;
+
+// Seed of the run, the file of --record (-1 without) and the decisions of --replay
+static uint64_t run_seed;
+static int record_fd = -1;
+static Replay *replay = NULL;
+
+/*
+ *  Funtion: splitmix64
+ *  -------------------
+ *  Returns: next number of the splitmix64 sequence of the state
+ */
+uint64_t splitmix64(uint64_t *state)
+{
+    uint64_t z = (*state += UINT64_C(0x9E3779B97F4A7C15));
+    z = (z ^ (z >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+    z = (z ^ (z >> 27)) * UINT64_C(0x94D049BB133111EB);
+    return z ^ (z >> 31);
+}
+
+/*
+ *  Funtion: rng_seed
+ *  -----------------
+ *  Seeds the generator of the worker id of the role from the seed of the run
+ */
+void rng_seed(Rng *rng, ProcessType role, int id)
+{
+    uint64_t state = run_seed ^ ((uint64_t)role << 56) ^ ((uint64_t)(uint32_t)id * UINT64_C(0xD1B54A32D192ED03));
+    for (int i = 0; i < 4; i++) {
+        rng->s[i] = splitmix64(&state);
+    }
+}
+
+/*
+ *  Funtion: rng_next
+ *  -----------------
+ *  Returns: next 64 random bits (xoshiro256**)
+ */
+uint64_t rng_next(Rng *rng)
+{
+    uint64_t *s = rng->s;
+    uint64_t x = s[1] * 5;
+    uint64_t result = ((x << 7) | (x >> 57)) * 9;
+    uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = (s[3] << 45) | (s[3] >> 19);
+    return result;
+}
+
+/*
+ *  Funtion: rng_below
+ *  ------------------
+ *  Returns: random number in 0..n-1, n below 2^32
+ */
+uint32_t rng_below(Rng *rng, uint32_t n)
+{
+    return (uint32_t)(((rng_next(rng) >> 32) * n) >> 32);
+}
+
+/*
+ *  Funtion: rng_unit
+ *  -----------------
+ *  Returns: random number in (0, 1)
+ */
+double rng_unit(Rng *rng)
+{
+    return ((rng_next(rng) >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ *  Funtion: process_info_init
+ *  --------------------------
+ *  Fills in the worker of the role with the id and its generator,
+ *  decisions recorded by a parent are not taken over
+ */
+void process_info_init(ProcessInfo *process_info, ProcessType type, int id)
+{
+    *process_info = (ProcessInfo){ .type = type, .id = id };
+    if (type == ZAKAZNIK) process_info->slot = id;
+    if (type == URADNIK) process_info->next_lane = (id - 1) % service_types;
+    rng_seed(&process_info->rng, type, id);
+}
+
+/*
+ *  Funtion: decisions_flush
+ *  ------------------------
+ *  Writes the recorded decisions of the worker into the file of --record
+ */
+void decisions_flush(ProcessInfo *process_info)
+{
+    if (process_info->num_recorded > 0) {
+        size_t size = process_info->num_recorded * sizeof(Decision);
+        if (write(record_fd, process_info->recorded, size) != (ssize_t)size) {
+            fprintf(stderr, "Error: Failed to write the recorded decisions\n");
+        }
+    }
+    free(process_info->recorded);
+    process_info->recorded = NULL;
+    process_info->num_recorded = 0;
+    process_info->recorded_capacity = 0;
+}
+
+/*
+ *  Funtion: decision
+ *  -----------------
+ *  Passes a drawn value of the worker through record and replay,
+ *  --record stores it, --replay replaces it with the next recorded
+ *  decision of the kind of the worker, none left
+ *  counts as a divergence and the drawn value is kept
+ *  The buffer of a worker grows from a few decisions, a customer makes three
+ *  Returns: the value to use
+ */
+int64_t decision(ProcessInfo *process_info, DecisionKind kind, int64_t value)
+{
+    if (record_fd != -1)
+    {
+        if (process_info->num_recorded == process_info->recorded_capacity)
+        {
+            if (process_info->recorded_capacity == RECORD_BATCH) decisions_flush(process_info);
+            int capacity = process_info->recorded_capacity == 0 ? 4 : 2 * process_info->recorded_capacity;
+            Decision *recorded = realloc(process_info->recorded, capacity * sizeof(Decision));
+            if (recorded == NULL) return value;
+            process_info->recorded = recorded;
+            process_info->recorded_capacity = capacity;
+        }
+        process_info->recorded[process_info->num_recorded++] = (Decision){ .value = value, .id = process_info->id,
+                                                                           .role = process_info->type, .kind = kind };
+        return value;
+    }
+
+    if (replay == NULL) return value;
+
+    ProcessType role = process_info->type;
+    int key = process_info->id * DECISION_KINDS + kind;
+    if (key >= 0 && key < replay->num_keys[role])
+    {
+        int next = atomic_load_explicit(&replay->next[role][key], memory_order_relaxed);
+        if (next < replay->start[role][key + 1]) {
+            atomic_store_explicit(&replay->next[role][key], next + 1, memory_order_relaxed);
+            return replay->decisions[next].value;
+        }
+    }
+    atomic_fetch_add(&replay->divergences, 1);
+    return value;
+}
+
+/*
+ *  Funtion: record_open
+ *  --------------------
+ *  Creates the file of --record with the seed of the run, the workers
+ *  append their decisions with single writes through O_APPEND
+ *  Returns: 0 (if the file was created)
+ *           else (not)
+ */
+int record_open(const char *path)
+{
+    record_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (record_fd == -1) {
+        fprintf(stderr, "Error: Failed to open the record file %s\n", path);
+        return 1;
+    }
+
+    RecordHeader header = { .version = RECORD_VERSION, .record_size = sizeof(Decision), .seed = run_seed };
+    memcpy(header.magic, RECORD_MAGIC, sizeof(header.magic));
+    if (write(record_fd, &header, sizeof(header)) != sizeof(header)) {
+        fprintf(stderr, "Error: Failed to write the record file %s\n", path);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ *  Funtion: replay_load
+ *  --------------------
+ *  Reads the decisions of a file of --record and sorts them by role,
+ *  id and kind keeping their order (counting sort), the seed of the run
+ *  becomes the recorded one
+ *  Returns: 0 (if the decisions were loaded)
+ *           else (not)
+ */
+int replay_load(const char *path)
+{
+    FILE *in = fopen(path, "r");
+    struct stat st;
+    RecordHeader header;
+    if (in == NULL || fstat(fileno(in), &st) == -1 || fread(&header, sizeof(header), 1, in) != 1
+        || memcmp(header.magic, RECORD_MAGIC, sizeof(header.magic)) != 0 || header.version != RECORD_VERSION
+        || header.record_size != sizeof(Decision)) {
+        fprintf(stderr, "Error: %s is not a record of proj2 of version %d\n", path, RECORD_VERSION);
+        if (in != NULL) fclose(in);
+        return 1;
+    }
+
+    size_t count = (st.st_size - sizeof(header)) / sizeof(Decision);
+    Decision *read_decisions = malloc((count + 1) * sizeof(Decision));
+    if (read_decisions == NULL || fread(read_decisions, sizeof(Decision), count, in) != count) {
+        fprintf(stderr, "Error: Failed to read the record file %s\n", path);
+        free(read_decisions);
+        fclose(in);
+        return 1;
+    }
+    fclose(in);
+
+    int num_keys[URADNIK + 1] = { 0 };
+    for (size_t i = 0; i < count; i++) {
+        Decision *d = &read_decisions[i];
+        if (d->role > URADNIK || d->kind >= DECISION_KINDS || d->id < 0 || d->id >= INT_MAX / DECISION_KINDS) {
+            fprintf(stderr, "Error: Decision %zu of %s is damaged\n", i + 1, path);
+            free(read_decisions);
+            return 1;
+        }
+        if (d->id * DECISION_KINDS + d->kind >= num_keys[d->role]) num_keys[d->role] = d->id * DECISION_KINDS + d->kind + 1;
+    }
+
+    // The index and the sorted decisions in one shared mapping
+    size_t size = sizeof(Replay) + (count + 1) * sizeof(Decision);
+    for (int role = 0; role <= URADNIK; role++) {
+        size += (2 * (size_t)num_keys[role] + 2) * sizeof(int);
+    }
+    char *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        fprintf(stderr, "Error: Failed to allocate the decisions of %s\n", path);
+        free(read_decisions);
+        return 1;
+    }
+
+    replay = (Replay *)memory;
+    replay->decisions = (Decision *)(memory + sizeof(Replay));
+    int *index = (int *)(replay->decisions + count + 1);
+    for (int role = 0; role <= URADNIK; role++) {
+        replay->num_keys[role] = num_keys[role];
+        replay->start[role] = index;
+        replay->next[role] = (_Atomic int *)(index + num_keys[role] + 1);
+        index += 2 * num_keys[role] + 2;
+    }
+
+    // Counts, their running sums, then every decision after the earlier ones of its key
+    for (size_t i = 0; i < count; i++) {
+        Decision *d = &read_decisions[i];
+        replay->start[d->role][d->id * DECISION_KINDS + d->kind + 1]++;
+    }
+    int total = 0;
+    for (int role = 0; role <= URADNIK; role++) {
+        replay->start[role][0] = total;
+        for (int key = 0; key < num_keys[role]; key++) {
+            total += replay->start[role][key + 1];
+            replay->start[role][key + 1] = total;
+            replay->next[role][key] = replay->start[role][key];
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        Decision *d = &read_decisions[i];
+        replay->decisions[replay->next[d->role][d->id * DECISION_KINDS + d->kind]++] = *d;
+    }
+    for (int role = 0; role <= URADNIK; role++) {
+        for (int key = 0; key < num_keys[role]; key++) {
+            replay->next[role][key] = replay->start[role][key];
+        }
+    }
+
+    free(read_decisions);
+    run_seed = header.seed;
+    return 0;
+}
+
+/*
+ *  Funtion: create_processes
+ *  -------------------------
+ *  Creates all child processes as a spawn tree,
+ *  every process forks the upper half of its range of processes,
+ *  so all are started after a logarithmic number of forks
+ *  A child takes the first process of its range,
+ *  officers are the first, then customers
+ *  Returns: number of children of the process
+ */
+int create_processes(int num_zakaznik, int num_uradnik, ProcessInfo* process_info, Shared_memory *shm) {
+    int first = 1;
+    int last = num_zakaznik + num_uradnik;
+    int children = 0;
+
+    while (first <= last) {
+        int middle = first + (last - first) / 2;
+        pid_t parent = getpid();
+        pid_t pid = fork();
+        if (pid == -1) {
+            fprintf(stderr, "Failed to create child process %d\n", first);
+            exit(1);
+        } else if (pid == 0) {
+            // This is the child process, it goes on with the lower half
+            die_with_parent(parent);
+            if (first <= num_uradnik) process_info_init(process_info, URADNIK, first);
+            else process_info_init(process_info, ZAKAZNIK, first - num_uradnik);
+            children = 0;
+            last = middle;
+            first++;
+        } else {
+            children++;
+            first = middle + 1;
+        }
+    }
+
+    if (process_info->type != MAIN) mark_started(shm);
+    return children;
+}
+
+/*
+ *  Funtion: create_threads
+ *  -----------------------
+ *  Threaded counterpart of create_processes
+ *  Starts every officer and customer as a thread
+ *  of the main process, officers first
+ *  Returns: 0 (if all threads were started)
+ *           else (not)
+ */
+int create_threads(int num_zakaznik, int num_uradnik, int TZ, int TU, Shared_memory *shm,
+                   WorkerArgs *workers, pthread_t *threads)
+{
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
+
+    for (int i = 1; i <= num_zakaznik + num_uradnik; i++) {
+        WorkerArgs *w = &workers[i - 1];
+        if (i <= num_uradnik) {
+            process_info_init(&w->process_info, URADNIK, i);
+            w->time_limit = TU;
+        } else {
+            process_info_init(&w->process_info, ZAKAZNIK, i - num_uradnik);
+            w->time_limit = TZ;
+        }
+        w->shm = shm;
+        w->late = false;
+
+        if (pthread_create(&threads[i - 1], &attr, worker_thread, w) != 0) {
+            fprintf(stderr, "Failed to create thread %d\n", i);
+            pthread_attr_destroy(&attr);
+            return 1;
+        }
+    }
+    pthread_attr_destroy(&attr);
+    return 0;
+}
+
+/*
+ *  Function: sem_inicialization
+ *  ----------------------------
+ *  Provides inicialization of semaphores
+ *  Returns: 0 (if the initialization took place correctly)
+ *           else (not) 
+ */
+int sem_inicialization(sem_t *sem, int init_value)
+{
+	if (sem_init(sem, !threads_mode, init_value) == -1)
+	{
+		fprintf(stderr, "%s\n", "Error: Sem_init failed.");
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ *  ________LOCK PROFILE__________
+ *  Every wait and post of the semaphores goes through lock_wait,
+ *  lock_trywait and lock_post, with --lock-profile they count
+ *  the waits and the time blocked per semaphore and role
+ */
+
+typedef enum {
+    LOCK_WORK,
+    LOCK_LANE,
+    LOCK_CALLED,
+    LOCK_CALLING_BEFORE_DONE,
+    LOCK_FREE,
+    LOCK_POOL,
+    LOCK_CLOSED,
+    LOCK_COUNT
+} LockId;
+
+// Roles are the ProcessType values
+#define LOCK_ROLES 3
+
+static const char *lock_names[LOCK_COUNT] = {
+    [LOCK_WORK] = "sem_work",
+    [LOCK_LANE] = "sem_lane",
+    [LOCK_CALLED] = "sem_called",
+    [LOCK_CALLING_BEFORE_DONE] = "sem_calling_before_done",
+    [LOCK_FREE] = "sem_free",
+    [LOCK_POOL] = "sem_pool",
+    [LOCK_CLOSED] = "sem_closed",
+};
+
+static const char *lock_role_names[LOCK_ROLES] = {
+    [MAIN] = "main",
+    [ZAKAZNIK] = "customer",
+    [URADNIK] = "officer",
+};
+
+/*
+ *  Structure: LockStats
+ *  --------------------
+ *  Use of one semaphore by one role, sem_wait calls, those that
+ *  had to sleep and for how long, sem_trywait calls and those that
+ *  failed, and sem_post calls
+ */
+typedef struct {
+    _Alignas(CACHE_LINE) _Atomic uint64_t waits;
+    _Atomic uint64_t blocked;
+    _Atomic uint64_t blocked_ns;
+    _Atomic uint64_t max_blocked_ns;
+    _Atomic uint64_t tries;
+    _Atomic uint64_t busy;
+    _Atomic uint64_t posts;
+} LockStats;
+
+// LOCK_COUNT x LOCK_ROLES statistics in the shared memory, NULL without --lock-profile
+static LockStats *lock_profile = NULL;
+
+// Role of the calling process or thread
+static _Thread_local ProcessType lock_role = MAIN;
+
+/*
+ *  Funtion: lock_profile_create
+ *  ----------------------------
+ *  Zeroed statistics of all semaphores and roles, shared
+ *  with the forked processes like the shared memory
+ *  Returns: 0 (if the profile was created)
+ *           else (not)
+ */
+int lock_profile_create(void)
+{
+    void *profile = mmap(NULL, LOCK_COUNT * LOCK_ROLES * sizeof(LockStats), PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (profile == MAP_FAILED) return 1;
+
+    lock_profile = profile;
+    return 0;
+}
+
+/*
+ *  Funtion: lock_stats
+ *  -------------------
+ *  Returns: statistics of the semaphore for the role of the caller
+ */
+LockStats *lock_stats(LockId id)
+{
+    return &lock_profile[id * LOCK_ROLES + lock_role];
+}
+
+/*
+ *  Funtion: lock_wait
+ *  ------------------
+ *  sem_wait, measures the time only when the semaphore is not free
+ */
+void lock_wait(LockId id, sem_t *sem)
+{
+    if (lock_profile == NULL) {
+        sem_wait(sem);
+        return;
+    }
+
+    LockStats *ls = lock_stats(id);
+    atomic_fetch_add_explicit(&ls->waits, 1, memory_order_relaxed);
+    if (sem_trywait(sem) == 0) return;
+
+    int64_t start = now_ns();
+    sem_wait(sem);
+    uint64_t blocked = now_ns() - start;
+
+    atomic_fetch_add_explicit(&ls->blocked, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&ls->blocked_ns, blocked, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&ls->max_blocked_ns, memory_order_relaxed);
+    while (blocked > max && !atomic_compare_exchange_weak(&ls->max_blocked_ns, &max, blocked));
+}
+
+/*
+ *  Funtion: lock_trywait
+ *  ---------------------
+ *  sem_trywait
+ *  Returns: 0 (if the semaphore was decremented)
+ *           -1 (if it was zero)
+ */
+int lock_trywait(LockId id, sem_t *sem)
+{
+    int result = sem_trywait(sem);
+
+    if (lock_profile != NULL) {
+        LockStats *ls = lock_stats(id);
+        atomic_fetch_add_explicit(&ls->tries, 1, memory_order_relaxed);
+        if (result == -1) atomic_fetch_add_explicit(&ls->busy, 1, memory_order_relaxed);
+    }
+    return result;
+}
+
+/*
+ *  Funtion: lock_timedwait
+ *  -----------------------
+ *  sem_timedwait until the CLOCK_REALTIME time, measured like lock_wait
+ *  Returns: 0 (if the semaphore was decremented)
+ *           -1 (if the time passed or a signal came, errno tells)
+ */
+int lock_timedwait(LockId id, sem_t *sem, const struct timespec *until)
+{
+    if (lock_profile == NULL) return sem_timedwait(sem, until);
+
+    LockStats *ls = lock_stats(id);
+    atomic_fetch_add_explicit(&ls->waits, 1, memory_order_relaxed);
+    if (sem_trywait(sem) == 0) return 0;
+
+    int64_t start = now_ns();
+    int result = sem_timedwait(sem, until);
+    uint64_t blocked = now_ns() - start;
+
+    atomic_fetch_add_explicit(&ls->blocked, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&ls->blocked_ns, blocked, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&ls->max_blocked_ns, memory_order_relaxed);
+    while (blocked > max && !atomic_compare_exchange_weak(&ls->max_blocked_ns, &max, blocked));
+    return result;
+}
+
+/*
+ *  Funtion: lock_post
+ *  ------------------
+ *  sem_post
+ */
+void lock_post(LockId id, sem_t *sem)
+{
+    if (lock_profile != NULL) atomic_fetch_add_explicit(&lock_stats(id)->posts, 1, memory_order_relaxed);
+    sem_post(sem);
+}
+
+/*
+ *  Funtion: write_lock_profile
+ *  ---------------------------
+ *  Writes the statistics of all used semaphores, the most
+ *  blocked first, into the file, stderr if path is "-"
+ *  Returns: 0 (if the profile was written)
+ *           else (not)
+ */
+int write_lock_profile(const char *path)
+{
+    FILE *out = strcmp(path, "-") == 0 ? stderr : fopen(path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Error: Failed to open the lock profile file %s\n", path);
+        return 1;
+    }
+
+    int order[LOCK_COUNT * LOCK_ROLES];
+    int count = 0;
+    for (int i = 0; i < LOCK_COUNT * LOCK_ROLES; i++) {
+        LockStats *ls = &lock_profile[i];
+        if (atomic_load(&ls->waits) + atomic_load(&ls->tries) + atomic_load(&ls->posts) == 0) continue;
+
+        int j = count++;
+        for (; j > 0 && atomic_load(&lock_profile[order[j - 1]].blocked_ns) < atomic_load(&ls->blocked_ns); j--) {
+            order[j] = order[j - 1];
+        }
+        order[j] = i;
+    }
+
+    fprintf(out, "%-24s %-8s %10s %10s %12s %10s %10s %10s %10s\n", "semaphore", "role",
+            "waits", "blocked", "blocked_ms", "max_us", "tries", "busy", "posts");
+    for (int i = 0; i < count; i++) {
+        LockStats *ls = &lock_profile[order[i]];
+        fprintf(out, "%-24s %-8s %10" PRIu64 " %10" PRIu64 " %12.3f %10.1f %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n",
+                lock_names[order[i] / LOCK_ROLES], lock_role_names[order[i] % LOCK_ROLES],
+                atomic_load(&ls->waits), atomic_load(&ls->blocked), atomic_load(&ls->blocked_ns) / 1e6,
+                atomic_load(&ls->max_blocked_ns) / 1e3, atomic_load(&ls->tries), atomic_load(&ls->busy),
+                atomic_load(&ls->posts));
+    }
+
+    if (out != stderr && fclose(out) == EOF) {
+        fprintf(stderr, "Error: Failed to write the lock profile file %s\n", path);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ *  Function: office_is_open
+ *  ------------------------
+ *  Returns: true (if the post office accepts new arrivals)
+ */
+bool office_is_open(Shared_memory *shm)
+{
+    return (atomic_load(&shm->log_head) & LOG_CLOSED_BIT) == 0;
+}
+
+/*
+ *  Function: wait_closed_until
+ *  ---------------------------
+ *  Sleeps until the deadline (now_ns time) or the closing of the post,
+ *  whichever comes first, sem_closed is a latch, main posts it once
+ *  and every worker it wakes passes it on to the next one
+ *  Returns: true (if the post office closed before the deadline)
+ */
+bool wait_closed_until(Shared_memory *shm, int64_t deadline)
+{
+    int64_t left = deadline - now_ns();
+    if (left <= 0) return !office_is_open(shm);
+
+    // sem_timedwait takes the time of CLOCK_REALTIME
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    int64_t ns = until.tv_nsec + left % 1000000000;
+    until.tv_sec += left / 1000000000 + ns / 1000000000;
+    until.tv_nsec = ns % 1000000000;
+
+    while (lock_timedwait(LOCK_CLOSED, &shm->sem_closed, &until) == -1) {
+        if (errno == ETIMEDOUT) return false;
+    }
+    lock_post(LOCK_CLOSED, &shm->sem_closed);
+    return true;
+}
+
+/*
+ *  Function: log_publish
+ *  ---------------------
+ *  Stores a log line under its reserved sequence number
+ *  Waits only when the ring is full and the writer is behind
+ */
+void log_publish(Shared_memory *shm, uint64_t seq, ProcessType type, int id, LogEvent event, int service)
+{
+    LogRecord *r = &shm->log_ring[seq & (LOG_RING_SIZE - 1)];
+
+    while (atomic_load_explicit(&r->sequence, memory_order_acquire) != seq) {
+        sched_yield();
+    }
+
+    if (binary_log) r->time_ns = now_ns() - log_start_ns;
+    r->id = id;
+    r->type = type;
+    r->event = event;
+    r->service = service;
+    atomic_store_explicit(&r->sequence, seq + 1, memory_order_release);
+}
+
+/*
+ *  Function: write_log
+ *  -------------------
+ *  Writes processes log messages
+ */
+void write_log(Shared_memory *shm, ProcessInfo* process_info, LogEvent event, int service)
+{   
+    uint64_t seq = atomic_fetch_add(&shm->log_head, 1) & ~LOG_CLOSED_BIT;
+    log_publish(shm, seq, process_info->type, process_info->id, event, service);
+}
+
+/*
+ *  Function: write_log_if_open
+ *  ---------------------------
+ *  Writes the log message only if the post office
+ *  is not closed yet
+ *  Returns: true (if the message was written)
+ */
+bool write_log_if_open(Shared_memory *shm, ProcessInfo* process_info, LogEvent event, int service)
+{
+    uint64_t head = atomic_load(&shm->log_head);
+    do {
+        if (head & LOG_CLOSED_BIT) return false;
+    } while (!atomic_compare_exchange_weak(&shm->log_head, &head, head + 1));
+
+    log_publish(shm, head, process_info->type, process_info->id, event, service);
+    return true;
+}
+
+/*
+ *  Function: write_log_closing
+ *  ---------------------------
+ *  Closes the post office and writes the closing message
+ */
+void write_log_closing(Shared_memory *shm)
+{
+    uint64_t head = atomic_load(&shm->log_head);
+    while (!atomic_compare_exchange_weak(&shm->log_head, &head, (head + 1) | LOG_CLOSED_BIT));
+
+    log_publish(shm, head & ~LOG_CLOSED_BIT, MAIN, 0, LOG_CLOSING, 0);
+}
+
+/*
+ *  Function: format_log_record
+ *  ---------------------------
+ *  Formats one log line in the proj2.out format
+ *  Returns: length of the line
+ */
+int format_log_record(char *buf, uint64_t number, const LogRecord *r)
+{
+    return log_format_line(buf, number, r->type, r->id, r->event, r->service);
+}
+
+/*
+ *  Function: binary_log_record
+ *  ---------------------------
+ *  Stores one log line as a record of the binary log
+ *  Returns: size of the record
+ */
+int binary_log_record(char *buf, uint64_t number, const LogRecord *r)
+{
+    LogFileRecord record = {
+        .seq = number, .time_ns = r->time_ns, .id = r->id,
+        .service = r->service, .type = r->type, .event = r->event
+    };
+    memcpy(buf, &record, sizeof(record));
+    return sizeof(record);
+}
+
+/*
+ *  Function: write_log_header
+ *  --------------------------
+ *  Starts the binary log, flushed by the caller before the writer forks
+ *  Returns: 0 (if the header was written)
+ *           else (not)
+ */
+int write_log_header(FILE *f)
+{
+    LogFileHeader header = { .version = LOG_FILE_VERSION, .record_size = sizeof(LogFileRecord) };
+    memcpy(header.magic, LOG_FILE_MAGIC, sizeof(header.magic));
+    return fwrite(&header, sizeof(header), 1, f) != 1;
+}
+
+/*
+ *  Function: log_flush
+ *  -------------------
+ *  Writes the buffered lines straight to the file,
+ *  one write call unless the kernel takes less
+ *  Returns: 0 (if everything was written)
+ *           else (not)
+ */
+int log_flush(Shared_memory *shm, int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t written = write(fd, buf, len);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            return 1;
+        }
+        shm->log_writes++;
+        buf += written;
+        len -= written;
+    }
+    return 0;
+}
+
+/*
+ *  Function: log_writer
+ *  --------------------
+ *  The only process (or thread) writing into proj2.out (or proj2.bin)
+ *  Drains the log ring in the order of sequence numbers into a buffer
+ *  of --log-buffer bytes, written when it is full, its oldest line is
+ *  --log-flush-ms old or at the end, until log_stop is set and every
+ *  reserved line is written or log_abort asks for the lines published so far
+ *  Between the batches the writer sleeps longer and longer up to
+ *  LOG_WRITER_MAX_IDLE_US, shortly again once the ring fills
+ */
+void log_writer(Shared_memory *shm, FILE* f, char *buf)
+{
+    int (*format)(char *, uint64_t, const LogRecord *) = binary_log ? binary_log_record : format_log_record;
+    int fd = fileno(f);
+    uint64_t next = 0;
+    size_t len = 0;
+    int64_t flush_ns = 0;
+    int idle_us = LOG_WRITER_IDLE_US;
+    bool failed = false;
+
+    while (true)
+    {
+        bool aborted = atomic_load(&shm->log_abort);
+        int count = 0;
+
+        // Room for a whole line is left
+        while (len + LOG_LINE_MAX <= log_buffer_size)
+        {
+            LogRecord *r = &shm->log_ring[next & (LOG_RING_SIZE - 1)];
+            if (atomic_load_explicit(&r->sequence, memory_order_acquire) != next + 1) break;
+
+            if (len == 0) flush_ns = now_ns() + log_flush_ms * INT64_C(1000000);
+            len += format(buf + len, next + 1, r);
+            atomic_store_explicit(&r->sequence, next + LOG_RING_SIZE, memory_order_release);
+            next++;
+            count++;
+        }
+
+        // Every worker is done, so every reserved line is published
+        bool stop = aborted || (atomic_load(&shm->log_stop) && next == (atomic_load(&shm->log_head) & ~LOG_CLOSED_BIT));
+        bool full = len + LOG_LINE_MAX > log_buffer_size;
+        if (len > 0 && (stop || full || now_ns() >= flush_ns))
+        {
+            if (log_flush(shm, fd, buf, len) != 0 && !failed) {
+                fprintf(stderr, "Error: Failed to write the log\n");
+                failed = true;
+            }
+            len = 0;
+            atomic_store_explicit(&shm->stats->log_lines, next, memory_order_relaxed);
+        }
+        if (stop) break;
+
+        // A ring filling up is drained right away, a trickle of lines waits
+        if (full || count > LOG_RING_SIZE / 4) {
+            idle_us = LOG_WRITER_IDLE_US;
+            continue;
+        }
+        usleep(idle_us);
+        shm->log_sleeps++;
+        if (idle_us < LOG_WRITER_MAX_IDLE_US) idle_us *= 2;
+    }
+    atomic_store(&shm->log_flushed, true);
+}
+
+/*
+ *  Function: log_writer_thread
+ *  ---------------------------
+ *  Entry point of the log writer in the threaded mode
+ */
+void *log_writer_thread(void *arg)
+{
+    LogWriterArgs *w = arg;
+
+    // The signals go to the other threads, the writer is the one waited for
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGQUIT);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    log_writer(w->shm, w->f, w->buf);
+    return NULL;
+}
+
+/*
+ *  Function: log_writer_signal
+ *  ---------------------------
+ *  The log writer process asked to end writes what it has and exits
+ */
+void log_writer_signal(int sig)
+{
+    (void)sig;
+    atomic_store(&log_shm->log_abort, true);
+}
+
+/*
+ *  Function: log_final_flush
+ *  -------------------------
+ *  Main exiting early (exit or a signal) asks the writer for the lines
+ *  published so far and waits for them at most LOG_FINAL_FLUSH_MS,
+ *  only async-signal-safe calls
+ */
+void log_final_flush(void)
+{
+    if (log_shm == NULL || getpid() != stats_owner || atomic_load(&log_shm->log_flushed)) return;
+
+    atomic_store(&log_shm->log_abort, true);
+    struct timespec pause = { 0, 1000000 };
+    for (int i = 0; i < LOG_FINAL_FLUSH_MS && !atomic_load(&log_shm->log_flushed); i++) {
+        nanosleep(&pause, NULL);
+    }
+}
+
+/*
+ *  ________SCHEDULERS__________
+ */
+
+/*
+ *  Function: lane_next_set
+ *  -----------------------
+ *  Finds the first non-empty queue from the index on,
+ *  continuing from the first queue after the last one
+ *  Returns: index of the queue, -1 if all are empty
+ */
+int lane_next_set(LaneSet *set, int from)
+{
+    int words = (set->count + 63) / 64;
+    int w = from / 64;
+    uint64_t bits = atomic_load(&set->bitmap[w]) & (~0ULL << (from % 64));
+
+    for (int i = 0; i <= words; i++) {
+        if (bits != 0) return w * 64 + __builtin_ctzll(bits);
+        w = (w + 1) % words;
+        bits = atomic_load(&set->bitmap[w]);
+    }
+    return -1;
+}
+
+/*
+ *  Function: schedule_random
+ *  -------------------------
+ *  Provides REAL RANDOMIZATION of post officer's choice of queue,
+ *  the first non-empty one from a random queue on
+ */
+int schedule_random(LaneSet *set, Rng *rng, int *next_lane)
+{
+    (void)next_lane;
+    return lane_next_set(set, rng_below(rng, set->count)) + 1;
+}
+
+/*
+ *  Function: schedule_longest
+ *  --------------------------
+ *  Longest queue first, ties are broken randomly
+ */
+int schedule_longest(LaneSet *set, Rng *rng, int *next_lane)
+{
+    (void)next_lane;
+    int best = -1, best_length = 0, ties = 0;
+
+    for (int w = 0; w < (set->count + 63) / 64; w++) {
+        for (uint64_t bits = atomic_load(&set->bitmap[w]); bits != 0; bits &= bits - 1) {
+            int i = w * 64 + __builtin_ctzll(bits);
+            int length = atomic_load(&set->lanes[i].length);
+            if (length > best_length) {
+                best = i;
+                best_length = length;
+                ties = 1;
+            } else if (length == best_length && rng_below(rng, ++ties) == 0) {
+                best = i;
+            }
+        }
+    }
+    return best + 1;
+}
+
+/*
+ *  Function: schedule_oldest
+ *  -------------------------
+ *  The queue whose first customer waits the longest first
+ */
+int schedule_oldest(LaneSet *set, Rng *rng, int *next_lane)
+{
+    (void)rng;
+    (void)next_lane;
+    int best = -1;
+    int64_t best_time = INT64_MAX;
+
+    for (int w = 0; w < (set->count + 63) / 64; w++) {
+        for (uint64_t bits = atomic_load(&set->bitmap[w]); bits != 0; bits &= bits - 1) {
+            int i = w * 64 + __builtin_ctzll(bits);
+            int64_t time = atomic_load(&set->lanes[i].head_enter_ns);
+            if (best == -1 || time < best_time) {
+                best = i;
+                best_time = time;
+            }
+        }
+    }
+    return best + 1;
+}
+
+/*
+ *  Function: schedule_round_robin
+ *  ------------------------------
+ *  Every officer cycles through the queues,
+ *  starting after the queue it served last
+ */
+int schedule_round_robin(LaneSet *set, Rng *rng, int *next_lane)
+{
+    (void)rng;
+    int lane = lane_next_set(set, *next_lane);
+
+    if (lane >= 0) *next_lane = (lane + 1) % set->count;
+    return lane + 1;
+}
+
+/*
+ *  Function: schedule_weighted
+ *  ---------------------------
+ *  Picks a non-empty queue with a probability
+ *  proportional to the weight of its service
+ */
+int schedule_weighted(LaneSet *set, Rng *rng, int *next_lane)
+{
+    (void)next_lane;
+    int words = (set->count + 63) / 64;
+    uint64_t bitmap[(MAX_SERVICE_TYPES + 63) / 64];
+    int64_t total = 0;
+
+    // One snapshot for both passes, the queues keep changing
+    for (int w = 0; w < words; w++) {
+        bitmap[w] = atomic_load(&set->bitmap[w]);
+        for (uint64_t bits = bitmap[w]; bits != 0; bits &= bits - 1) {
+            total += service_weights[w * 64 + __builtin_ctzll(bits)];
+        }
+    }
+    if (total == 0) return 0;
+
+    int64_t pick = rng_below(rng, total);
+    for (int w = 0; w < words; w++) {
+        for (uint64_t bits = bitmap[w]; bits != 0; bits &= bits - 1) {
+            int i = w * 64 + __builtin_ctzll(bits);
+            if (pick < service_weights[i]) return i + 1;
+            pick -= service_weights[i];
+        }
+    }
+    return 0;
+}
+
+static const Scheduler schedulers[] = {
+    { "random", schedule_random },
+    { "longest", schedule_longest },
+    { "oldest", schedule_oldest },
+    { "round-robin", schedule_round_robin },
+    { "weighted", schedule_weighted },
+};
+
+/*
+ *  Function: find_scheduler
+ *  ------------------------
+ *  Returns: the scheduler of the name, NULL if there is none
+ */
+const Scheduler *find_scheduler(const char *name)
+{
+    for (size_t i = 0; i < sizeof(schedulers) / sizeof(schedulers[0]); i++) {
+        if (strcmp(schedulers[i].name, name) == 0) return &schedulers[i];
+    }
+    return NULL;
+}
+
+/*
+ *  Function: parse_weights
+ *  -----------------------
+ *  Parses comma separated positive weights of the services
+ *  Returns: 0 (if the weights are valid)
+ *           else (not)
+ */
+int parse_weights(const char *str)
+{
+    for (int i = 0; i < service_types; i++) {
+        char *end;
+        long weight = strtol(str, &end, 10);
+        if (end == str || weight <= 0 || weight > 1000000) return 1;
+        service_weights[i] = (int)weight;
+
+        if (i < service_types - 1) {
+            if (*end != ',') return 1;
+            str = end + 1;
+        } else if (*end != '\0') {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ *  Funtion: exit_closed_entrance
+ *  -----------------------------
+ *  Customer checks if post office is open
+ *  while entering it
+ *  Going home if it is closed 
+ *  Returns: true (if the customer went home)
+ */
+bool exit_closed_entrance(Shared_memory *shm, ProcessInfo* process_info, int type_service)
+{
+    // Officers do not go home while somebody is entering
+    atomic_fetch_add(&shm->waiting, 1);
+    if (write_log_if_open(shm, process_info, LOG_ENTERING, type_service)) return false;
+
+    atomic_fetch_sub(&shm->waiting, 1);
+    atomic_fetch_add(&shm->stats->turned_away, 1);
+    write_log(shm, process_info, LOG_GOING_HOME, 0);
+    atomic_fetch_add(&shm->stats->customers_done, 1);
+    return true;
+}
+
+/*
+ *  Funtion: lane_push
+ *  ------------------
+ *  Appends a customer to the queue of a service and marks
+ *  the queue in the bitmap, the caller holds the queue
+ */
+void lane_push(LaneSet *set, int type_service, int zakaznik, int64_t enter_ns)
+{
+    Lane *lane = &set->lanes[type_service - 1];
+
+    if (lane->head == lane->tail) {
+        atomic_store(&lane->head_enter_ns, enter_ns);
+        atomic_fetch_or(&set->bitmap[(type_service - 1) / 64], 1ULL << ((type_service - 1) % 64));
+    }
+    lane->ids[lane->tail] = zakaznik;
+    lane->tail = (lane->tail + 1) % lane->capacity;
+    atomic_fetch_add(&lane->length, 1);
+}
+
+/*
+ *  Funtion: lane_pop
+ *  -----------------
+ *  Removes the first customer of a non-empty queue, unmarks
+ *  the queue when it gets empty, the caller holds the queue
+ *  and sets head_enter_ns of a queue that is still not empty
+ *  Returns: id of the customer
+ */
+int lane_pop(LaneSet *set, int type_service)
+{
+    Lane *lane = &set->lanes[type_service - 1];
+    int zakaznik = lane->ids[lane->head];
+    lane->head = (lane->head + 1) % lane->capacity;
+
+    atomic_fetch_sub(&lane->length, 1);
+    if (lane->head == lane->tail) {
+        atomic_fetch_and(&set->bitmap[(type_service - 1) / 64], ~(1ULL << ((type_service - 1) % 64)));
+        atomic_store(&lane->head_enter_ns, INT64_MAX);
+    }
+    return zakaznik;
+}
+
+/*
+ *  Funtion: lane_enqueue
+ *  ---------------------
+ *  Customer in the slot joins the end of the queue for a service
+ */
+void lane_enqueue(Shared_memory *shm, int type_service, int slot)
+{
+    Lane *lane = &shm->queues.lanes[type_service - 1];
+
+    lock_wait(LOCK_LANE, &lane->sem_lane);
+    lane_push(&shm->queues, type_service, slot, shm->slots[slot - 1].enter_ns);
+    atomic_store_explicit(&shm->lane_stats[type_service - 1].length, atomic_load(&lane->length), memory_order_relaxed);
+    lock_post(LOCK_LANE, &lane->sem_lane);
+}
+
+/*
+ *  Funtion: lane_dequeue
+ *  ---------------------
+ *  Officer takes up to max first customers of the queue
+ *  in one acquisition of the queue
+ *  Returns: number of customer slots stored in zakaznici, 0 if the queue is empty
+ */
+int lane_dequeue(Shared_memory *shm, int type_service, int *zakaznici, int max)
+{
+    Lane *lane = &shm->queues.lanes[type_service - 1];
+    int count = 0;
+
+    // Skips the lock of an empty queue
+    if (atomic_load(&lane->length) == 0) return 0;
+
+    lock_wait(LOCK_LANE, &lane->sem_lane);
+    while (count < max && lane->head != lane->tail) {
+        zakaznici[count++] = lane_pop(&shm->queues, type_service);
+    }
+    if (lane->head != lane->tail) {
+        atomic_store(&lane->head_enter_ns, shm->slots[lane->ids[lane->head] - 1].enter_ns);
+    }
+    atomic_store_explicit(&shm->lane_stats[type_service - 1].length, atomic_load(&lane->length), memory_order_relaxed);
+    lock_post(LOCK_LANE, &lane->sem_lane);
+    return count;
+}
+
+/*
+ *  Funtion: officer_wait_before_task_done()
+ *  -----------------------------
+ *  Officer doing task, unsleep <0,10>
+ */
+void officer_wait_before_task_done(ProcessInfo* process_info)
+{
+    int officer_wait = decision(process_info, DECISION_TASK, rng_below(&process_info->rng, 11));
+    usleep(officer_wait);
+}
+
+/*
+ *  ________FIBERS__________
+ *  With --fibers the customers are fibers (ucontext) with small
+ *  stacks run by a few worker threads, a fiber gives its thread
+ *  back instead of sleeping or waiting to be called, the worker
+ *  resumes it from its timers or when an officer wakes it
+ *  The queues are only held for a moment, fibers do block on them
+ */
+
+/*
+ *  Structure: Fiber
+ *  ----------------
+ *  One customer of the fiber mode, kept at the top
+ *  of its stack, next links the lists of its worker
+ */
+typedef struct Fiber {
+    ucontext_t context;
+    ProcessInfo process_info;
+    struct FiberWorker *worker;
+    struct Fiber *next;
+} Fiber;
+
+/*
+ *  Structure: FiberTimer
+ *  ---------------------
+ *  Fiber to resume at wake_ns, or the arrival
+ *  of the customer arrivals[arrival] if fiber is NULL
+ */
+typedef struct {
+    int64_t wake_ns;
+    Fiber *fiber;
+    int arrival;
+} FiberTimer;
+
+/*
+ *  Structure: FiberWorker
+ *  ----------------------
+ *  Worker thread of the fiber mode and its event loop
+ *  Every customer of the worker has at most one timer, the ready
+ *  fibers are private, the woken ones are pushed by the officers
+ *  under lock, stacks are taken from one reserved region
+ */
+typedef struct FiberWorker {
+    pthread_t thread;
+    Shared_memory *shm;
+    ucontext_t scheduler;
+    Fiber *current;
+    bool finished;
+    int remaining;
+    FiberTimer *timers;
+    int num_timers;
+    // Customers of the worker with their arrival drawn
+    ProcessInfo *arrivals;
+    Fiber *ready_head;
+    Fiber *ready_tail;
+    char *stacks;
+    int stacks_used;
+    Fiber *free_fibers;
+    _Alignas(CACHE_LINE) pthread_mutex_t lock;
+    pthread_cond_t wake;
+    Fiber *woken;
+} FiberWorker;
+
+// Worker of the calling thread, NULL outside of the fiber mode
+static _Thread_local FiberWorker *fiber_worker = NULL;
+
+/*
+ *  Funtion: fiber_timer_push
+ *  -------------------------
+ *  Adds a timer to the min-heap of the worker
+ */
+void fiber_timer_push(FiberWorker *w, FiberTimer timer)
+{
+    int i = w->num_timers++;
+    while (i > 0 && w->timers[(i - 1) / 2].wake_ns > timer.wake_ns) {
+        w->timers[i] = w->timers[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    w->timers[i] = timer;
+}
+
+/*
+ *  Funtion: fiber_timer_pop
+ *  ------------------------
+ *  Returns: the earliest timer of the worker, removed from the heap
+ */
+FiberTimer fiber_timer_pop(FiberWorker *w)
+{
+    FiberTimer first = w->timers[0];
+    FiberTimer last = w->timers[--w->num_timers];
+    int i = 0;
+
+    while (2 * i + 1 < w->num_timers) {
+        int child = 2 * i + 1;
+        if (child + 1 < w->num_timers && w->timers[child + 1].wake_ns < w->timers[child].wake_ns) child++;
+        if (w->timers[child].wake_ns >= last.wake_ns) break;
+        w->timers[i] = w->timers[child];
+        i = child;
+    }
+    w->timers[i] = last;
+    return first;
+}
+
+/*
+ *  Funtion: fiber_ready
+ *  --------------------
+ *  Appends a fiber to the ready fibers of its worker
+ */
+void fiber_ready(FiberWorker *w, Fiber *f)
+{
+    f->next = NULL;
+    if (w->ready_tail == NULL) w->ready_head = f;
+    else w->ready_tail->next = f;
+    w->ready_tail = f;
+}
+
+/*
+ *  Funtion: fiber_park
+ *  -------------------
+ *  Running fiber gives the thread back to its worker,
+ *  returns once a timer or an officer made it ready
+ */
+void fiber_park(void)
+{
+    FiberWorker *w = fiber_worker;
+    swapcontext(&w->current->context, &w->scheduler);
+}
+
+/*
+ *  Funtion: fiber_sleep_us
+ *  -----------------------
+ *  usleep of a fiber, the worker resumes it from a timer
+ */
+void fiber_sleep_us(int64_t us)
+{
+    FiberWorker *w = fiber_worker;
+    fiber_timer_push(w, (FiberTimer){ now_ns() + us * 1000, w->current, 0 });
+    fiber_park();
+}
+
+/*
+ *  Funtion: fiber_wake
+ *  -------------------
+ *  Officer hands the fiber parked in the slot, if any,
+ *  back to its worker after posting sem_called
+ */
+void fiber_wake(CustomerSlot *slot)
+{
+    Fiber *f = atomic_exchange(&slot->parked, NULL);
+    if (f == NULL) return;
+
+    FiberWorker *w = f->worker;
+    pthread_mutex_lock(&w->lock);
+    f->next = w->woken;
+    w->woken = f;
+    pthread_cond_signal(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+}
+
+/*
+ *  Funtion: customer_sleep_us
+ *  --------------------------
+ *  usleep of a customer process, thread or fiber
+ */
+void customer_sleep_us(int64_t us)
+{
+    if (fiber_worker != NULL) fiber_sleep_us(us);
+    else usleep(us);
+}
+
+/*
+ *  Funtion: customer_wait_called
+ *  -----------------------------
+ *  Customer waits on sem_called of its slot, a fiber parks
+ *  in the slot first and then tries the semaphore, so either
+ *  it sees the post or the officer sees the fiber
+ *  If both happen, the wake of the officer is still taken
+ */
+void customer_wait_called(CustomerSlot *slot)
+{
+    if (fiber_worker == NULL) {
+        lock_wait(LOCK_CALLED, &slot->sem_called);
+        return;
+    }
+
+    while (lock_trywait(LOCK_CALLED, &slot->sem_called) == -1) {
+        atomic_store(&slot->parked, fiber_worker->current);
+        if (sem_trywait(&slot->sem_called) == 0) {
+            if (atomic_exchange(&slot->parked, NULL) == NULL) fiber_park();
+            return;
+        }
+        fiber_park();
+    }
+}
+
+/*
+ *  ________SERVER__________
+ *  With --server the customers are clients of a UNIX socket, main
+ *  runs their side of the post office in an epoll loop and the
+ *  officer threads tell it through an eventfd whom they called
+ */
+
+typedef enum {
+    CLIENT_CONNECTED,
+    CLIENT_QUEUED,
+    CLIENT_FINISHED
+} ClientState;
+
+/*
+ *  Structure: Client
+ *  -----------------
+ *  One connection holding a customer slot, fd is -1
+ *  once a queued client went away before it was called,
+ *  a finished client waits in the finished list until
+ *  no event of the batch can point to it
+ */
+typedef struct Client {
+    int fd;
+    ClientState state;
+    ProcessInfo process_info;
+    // Time the request arrived
+    int64_t request_ns;
+    int len;
+    char line[SERVER_LINE_MAX];
+    struct Client *next_finished;
+} Client;
+
+/*
+ *  Structure: Server
+ *  -----------------
+ *  State of the epoll loop, clients by their slot,
+ *  called is filled by the officers under lock
+ */
+typedef struct {
+    const char *path;
+    int listen_fd;
+    int epoll_fd;
+    int wake_fd;
+    Client **clients;
+    Client *finished;
+    int queued;
+    int next_id;
+    int connections;
+    int rejected;
+    int answered;
+    int64_t start_ns;
+    Histogram latency;
+    pthread_mutex_t lock;
+    int *called;
+    int num_called;
+    int *handling;
+} Server;
+
+// Server of the run, NULL without --server
+static Server *server = NULL;
+
+/*
+ *  Funtion: server_wake
+ *  --------------------
+ *  Officer tells the epoll loop it called the customer in the slot
+ */
+void server_wake(int slot)
+{
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&server->lock);
+    server->called[server->num_called++] = slot;
+    pthread_mutex_unlock(&server->lock);
+    if (write(server->wake_fd, &one, sizeof(one)) != sizeof(one)) {
+        fprintf(stderr, "Error: Failed to wake the server\n");
+    }
+}
+
+/*
+ *  Function: customer_arrival
+ *  --------------------------
+ *  Returns: random time in milliseconds before entering the Post office
+ */
+int customer_arrival(ProcessInfo* process_info, int TZ)
+{
+    return decision(process_info, DECISION_ARRIVAL, rng_below(&process_info->rng, TZ + 1));
+}
+
+/*
+ *  Function: customer_enter
+ *  ------------------------
+ *  Customer starts and joins the queue of the service and wakes up
+ *  an officer, or goes home if the post is closed,
+ *  type_service 0 chooses a random service
+ *  Returns: true (if the customer waits in a queue)
+ */
+bool customer_enter(ProcessInfo* process_info, Shared_memory *shm, int type_service)
+{
+    write_log(shm, process_info, LOG_STARTED, 0);
+
+    if(!office_is_open(shm))
+    {   
+        atomic_fetch_add(&shm->stats->turned_away, 1);
+        write_log(shm, process_info, LOG_GOING_HOME, 0);
+        atomic_fetch_add(&shm->stats->customers_done, 1);
+        return false;
+    }
+
+    // Chooses random servise at post office
+    if (type_service == 0) {
+        type_service = decision(process_info, DECISION_SERVICE, rng_below(&process_info->rng, service_types)) + 1;
+    }
+
+    if (exit_closed_entrance(shm, process_info, type_service)) return false;
+
+    // Enter post office if not closed
+    shm->slots[process_info->slot - 1].enter_ns = now_ns();
+    lane_enqueue(shm, type_service, process_info->slot);
+
+    // Wakes up an officer
+    lock_post(LOCK_WORK, &shm->sem_work);
+    return true;
+}
+
+/*
+ *  Function: customer_visit
+ *  ------------------------
+ *  Customer at the Post office, from started to going home
+ */
+void customer_visit(ProcessInfo* process_info, Shared_memory *shm)
+{
+    if (!customer_enter(process_info, shm, 0)) return;
+    CustomerSlot *slot = &shm->slots[process_info->slot - 1];
+
+    // Give signal that someone is waiting in the queue
+    customer_wait_called(slot);
+
+    write_log(shm, process_info, LOG_CALLED, 0);
+    // Synchronization called by office worker and service finished
+    lock_post(LOCK_CALLING_BEFORE_DONE, &slot->sem_calling_before_done);
+
+    int customer_wait = decision(process_info, DECISION_LEAVE, rng_below(&process_info->rng, 11));
+    customer_sleep_us(customer_wait);
+    write_log(shm, process_info, LOG_GOING_HOME, 0);
+    atomic_fetch_add(&shm->stats->customers_done, 1);
+}
+
+/*
+ *  Function: customer
+ *  ------------------
+ *  Life cycle of a custumer
+ *  Provides synchronization between processes
+ */
+void customer(ProcessInfo* process_info,int TZ, Shared_memory *shm)
+{   
+    lock_role = ZAKAZNIK;
+
+    // Waiting for the arrival ends early when the post closes
+    wait_closed_until(shm, now_ns() + customer_arrival(process_info, TZ) * INT64_C(1000000));
+    customer_visit(process_info, shm);
+    decisions_flush(process_info);
+}
+
+// How often an idle officer the autoscaler may send home looks if it was sent
+#define RETIRE_CHECK_NS 10000000
+
+/*
+ *  Function: officer_wait_work
+ *  ---------------------------
+ *  Officer sleeps until a customer posts sem_work, an officer
+ *  above min_officers wakes up meanwhile to see if it was sent home
+ *  Returns: true (if the officer took a token)
+ *           false (if it was sent home)
+ */
+bool officer_wait_work(ProcessInfo *process_info, Shared_memory *shm)
+{
+    if (process_info->id <= min_officers) {
+        lock_wait(LOCK_WORK, &shm->sem_work);
+        return true;
+    }
+
+    while (!atomic_load(&shm->retire[process_info->id - 1]))
+    {
+        // sem_timedwait takes the time of CLOCK_REALTIME
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        int64_t ns = until.tv_nsec + RETIRE_CHECK_NS;
+        until.tv_sec += ns / 1000000000;
+        until.tv_nsec = ns % 1000000000;
+
+        if (lock_timedwait(LOCK_WORK, &shm->sem_work, &until) == 0) {
+            // Main posts the closing tokens only for the officers at work,
+            // one taken after the officer was sent home goes back
+            if (!atomic_load(&shm->retire[process_info->id - 1])) return true;
+            lock_post(LOCK_WORK, &shm->sem_work);
+        }
+    }
+    return false;
+}
+
+/*
+ *  Function: urad
+ *  ------------------
+ *  Life cycle of a office worker
+ *  Provides synchronization between processes
+ */
+void urad(ProcessInfo* process_info, int TU, Shared_memory *shm)
+{
+    OfficerStats *stats = &shm->officers[process_info->id - 1];
+    lock_role = URADNIK;
+    pin_officer(process_info->id);
+
+    write_log(shm, process_info, LOG_STARTED, 0);
+    while(true)
+    {
+        // The officer sent home by the autoscaler leaves before the next customer
+        if (process_info->id > min_officers && atomic_load(&shm->retire[process_info->id - 1])) break;
+
+        // Office worker is taking break when nobody is waiting in queue and the post is opened,
+        // then sleeps until a customer enters or the post is closed
+        if (lock_trywait(LOCK_WORK, &shm->sem_work) == -1)
+        {
+            if (office_is_open(shm))
+            {
+                write_log(shm, process_info, LOG_TAKING_BREAK, 0);
+                atomic_fetch_add(&stats->breaks, 1);
+                atomic_store_explicit(&stats->state, OFFICER_BREAK, memory_order_relaxed);
+
+                // The closing of the post ends the break
+                int time_uradnik = decision(process_info, DECISION_BREAK, rng_below(&process_info->rng, TU + 1));
+                wait_closed_until(shm, now_ns() + time_uradnik * INT64_C(1000000));
+
+                write_log(shm, process_info, LOG_BREAK_FINISHED, 0);
+            }
+            atomic_store_explicit(&stats->state, OFFICER_IDLE, memory_order_relaxed);
+
+            // The autoscaler sends an idle officer home without a token
+            if (!officer_wait_work(process_info, shm)) break;
+        }
+        else if (process_info->id > min_officers && atomic_load(&shm->retire[process_info->id - 1]))
+        {
+            // The token belongs to an officer at work (see officer_wait_work)
+            lock_post(LOCK_WORK, &shm->sem_work);
+            break;
+        }
+
+        // Every waiting customer posts sem_work once, the officer claims
+        // the tokens of up to batch_size customers
+        int tokens = 1;
+        while (tokens < batch_size && lock_trywait(LOCK_WORK, &shm->sem_work) == 0) tokens++;
+
+        // The scheduler chooses a non-empty queue, another one
+        // if the queue was emptied by somebody else meanwhile
+        int zakaznici[MAX_BATCH];
+        int type_service = 0;
+        int count = 0;
+
+        while (count == 0)
+        {
+            type_service = scheduler->pick(&shm->queues, &process_info->rng, &process_info->next_lane);
+            if (type_service == 0) break;
+
+            // A replayed queue that is empty now is a divergence, the chosen one is kept
+            int replayed = decision(process_info, DECISION_LANE, type_service);
+            if (replayed >= 1 && replayed <= service_types && atomic_load(&shm->queues.lanes[replayed - 1].length) > 0) {
+                type_service = replayed;
+            } else if (replay != NULL) {
+                atomic_fetch_add(&replay->divergences, 1);
+            }
+            count = lane_dequeue(shm, type_service, zakaznici, tokens);
+        }
+
+        // Office worker is going home when the post is closed and all requirement are done,
+        // the tokens left are those main posted at closing, one per officer, it keeps one
+        bool home = count == 0 && !office_is_open(shm) && atomic_load(&shm->waiting) == 0;
+
+        // An officer sent home meanwhile leaves without a token, its tokens go back
+        bool retired = process_info->id > min_officers && atomic_load(&shm->retire[process_info->id - 1]);
+        if (count == 0 && retired) {
+            for (int i = 0; i < tokens; i++) {
+                lock_post(LOCK_WORK, &shm->sem_work);
+            }
+            break;
+        }
+
+        // Tokens of customers the officer did not take go back, every customer
+        // is queued before posting its token, so the officer finds nobody to serve
+        // only after the closing while somebody is still entering or is not served
+        // yet in the batch of another officer (or rarely when a queue was emptied
+        // under its hands), while the post is open every token has its customer
+        for (int i = home ? 1 : count; i < tokens; i++) {
+            lock_post(LOCK_WORK, &shm->sem_work);
+        }
+        if (home) break;
+        if (count == 0)
+        {
+            sched_yield();
+            continue;
+        }
+
+        // Serving the taken requirements one after another
+        atomic_store_explicit(&stats->state, OFFICER_SERVING, memory_order_relaxed);
+        int cpu = sched_getcpu();
+        if (cpu >= 0 && cpu < num_cpus) {
+            atomic_fetch_add_explicit(&shm->cpu_served[cpu].served, count, memory_order_relaxed);
+        }
+        for (int i = 0; i < count; i++)
+        {
+            CustomerSlot *slot = &shm->slots[zakaznici[i] - 1];
+            write_log(shm, process_info, LOG_SERVING, type_service);
+            atomic_fetch_add(&stats->served, 1);
+            atomic_fetch_sub(&shm->waiting, 1);
+            int64_t called_ns = now_ns();
+            hist_record(&shm->wait_hist[type_service - 1], called_ns - slot->enter_ns);
+
+            lock_post(LOCK_CALLED, &slot->sem_called);
+            if (fiber_workers > 0) fiber_wake(slot);
+            else if (server != NULL) server_wake(zakaznici[i]);
+
+            // Synchronization called by office worker and service finished
+            lock_wait(LOCK_CALLING_BEFORE_DONE, &slot->sem_calling_before_done);
+
+            officer_wait_before_task_done(process_info);
+            hist_record(&shm->service_hist[type_service - 1], now_ns() - called_ns);
+            write_log(shm, process_info, LOG_SERVICE_FINISHED, 0);
+        }
+    }
+
+    write_log(shm, process_info, LOG_GOING_HOME, 0);
+    atomic_store_explicit(&stats->state, OFFICER_HOME, memory_order_relaxed);
+    decisions_flush(process_info);
+}
+
+/*
+ *  ________AUTOSCALER__________
+ *  Main process adds officers while the post is open when
+ *  the queues grow and sends the extra ones home when idle
+ */
+
+// How often the autoscaler looks at the queues
+#define AUTOSCALE_INTERVAL_NS 1000000
+
+// Checks with empty queues before an officer is sent home
+#define AUTOSCALE_IDLE_CHECKS 50
+
+/*
+ *  Structure: Autoscaler
+ *  ---------------------
+ *  Officers 1..active are at work, min of them always,
+ *  officer_ns sums the time they were at work
+ */
+typedef struct {
+    int min;
+    int max;
+    int active;
+    int peak;
+    int idle_checks;
+    int64_t last_ns;
+    int64_t next_ns;
+    int64_t officer_ns;
+    // Officer processes forked by the autoscaler
+    int forked;
+    // Threaded mode, officer threads above min follow the customers in threads and workers
+    int num_zakaznik;
+    int TU;
+    pthread_t *threads;
+    WorkerArgs *workers;
+    bool *thread_started;
+} Autoscaler;
+
+/*
+ *  Funtion: autoscale_account
+ *  --------------------------
+ *  Adds the time of the officers at work until now
+ */
+void autoscale_account(Autoscaler *as, int64_t now)
+{
+    as->officer_ns += (now - as->last_ns) * as->active;
+    as->last_ns = now;
+}
+
+/*
+ *  Funtion: autoscale_start_officer
+ *  --------------------------------
+ *  Starts the officer as a thread or a forked process, the forked
+ *  process returns with process_info of the officer
+ *  Returns: 0 (if the officer was started)
+ *           else (not)
+ */
+int autoscale_start_officer(Autoscaler *as, Shared_memory *shm, ProcessInfo *process_info, int id)
+{
+    atomic_store(&shm->retire[id - 1], false);
+
+    if (threads_mode)
+    {
+        int index = as->num_zakaznik + id - 1;
+        WorkerArgs *w = &as->workers[index];
+
+        // The officer with the id went home before, its thread is done
+        if (as->thread_started[id - 1]) {
+            pthread_join(as->threads[index], NULL);
+            as->thread_started[id - 1] = false;
+        }
+
+        process_info_init(&w->process_info, URADNIK, id);
+        w->time_limit = as->TU;
+        w->shm = shm;
+        w->late = true;
+
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
+        int result = pthread_create(&as->threads[index], &attr, worker_thread, w);
+        pthread_attr_destroy(&attr);
+        as->thread_started[id - 1] = result == 0;
+        return result != 0;
+    }
+
+    pid_t parent = getpid();
+    pid_t pid = fork();
+    if (pid == -1) return 1;
+    if (pid == 0) {
+        die_with_parent(parent);
+        process_info_init(process_info, URADNIK, id);
+        return 0;
+    }
+    as->forked++;
+    return 0;
+}
+
+/*
+ *  Funtion: autoscale
+ *  ------------------
+ *  Adds an officer when there are more than scale_depth waiting customers
+ *  per officer or the longest waiting customer waits over scale_wait_ms,
+ *  sends the last officer home after AUTOSCALE_IDLE_CHECKS checks with
+ *  nobody waiting, a forked officer returns from here with its process_info
+ */
+void autoscale(Autoscaler *as, Shared_memory *shm, ProcessInfo *process_info)
+{
+    int64_t now = now_ns();
+    if (as->max == as->min || now < as->next_ns) return;
+    as->next_ns = now + AUTOSCALE_INTERVAL_NS;
+    autoscale_account(as, now);
+
+    int waiting = atomic_load(&shm->waiting);
+    int64_t oldest = INT64_MAX;
+    for (int i = 0; i < service_types; i++) {
+        int64_t enter_ns = atomic_load_explicit(&shm->queues.lanes[i].head_enter_ns, memory_order_relaxed);
+        if (enter_ns < oldest) oldest = enter_ns;
+    }
+
+    bool busy = waiting > scale_depth * as->active
+             || (scale_wait_ms > 0 && oldest != INT64_MAX && now - oldest > (int64_t)scale_wait_ms * 1000000);
+    as->idle_checks = waiting == 0 ? as->idle_checks + 1 : 0;
+
+    if (busy && as->active < as->max)
+    {
+        // An officer sent home before is back only once it left
+        int id = as->active + 1;
+        int state = atomic_load(&shm->officers[id - 1].state);
+        if (state != OFFICER_STARTING && state != OFFICER_HOME) return;
+
+        if (autoscale_start_officer(as, shm, process_info, id) != 0) {
+            fprintf(stderr, "Failed to start officer %d\n", id);
+            return;
+        }
+        if (process_info->type != MAIN) return;
+
+        as->active++;
+        if (as->active > as->peak) as->peak = as->active;
+        atomic_store(&shm->stats->active_officers, as->active);
+        write_log(shm, process_info, LOG_SCALE_UP, as->active);
+    }
+    else if (as->idle_checks >= AUTOSCALE_IDLE_CHECKS && as->active > as->min)
+    {
+        int state = atomic_load(&shm->officers[as->active - 1].state);
+        if (state != OFFICER_IDLE && state != OFFICER_BREAK) return;
+
+        // The officer sees the flag at the end of its break, at its next retire
+        // check (see officer_wait_work) or before its next customer, no token
+        // is posted for it so the other officers are not woken up
+        atomic_store(&shm->retire[as->active - 1], true);
+
+        as->active--;
+        as->idle_checks = 0;
+        atomic_store(&shm->stats->active_officers, as->active);
+        write_log(shm, process_info, LOG_SCALE_DOWN, as->active);
+    }
+}
+
+/*
+ *  Funtion: autoscale_open
+ *  -----------------------
+ *  Main process keeps the post open for the time in milliseconds
+ *  and watches the queues meanwhile
+ */
+void autoscale_open(Autoscaler *as, Shared_memory *shm, ProcessInfo *process_info, int time)
+{
+    if (as->max == as->min) {
+        usleep(time * 1000);
+        return;
+    }
+
+    int64_t end = now_ns() + (int64_t)time * 1000000;
+    int64_t now;
+    while ((now = now_ns()) < end)
+    {
+        autoscale(as, shm, process_info);
+        if (process_info->type != MAIN) return;
+
+        int64_t wake = as->next_ns < end ? as->next_ns : end;
+        if (wake > now) usleep((wake - now) / 1000);
+    }
+}
+
+/*
+ *  ________STREAMING__________
+ *  Open-loop arrivals at a given rate, customers get
+ *  a slot from the pool and return it when they leave
+ */
+
+// Samples of the queue depth taken during the stream
+#define STREAM_SAMPLES 200
+
+// Mean number of customers arriving together in the bursty mode
+#define STREAM_BURST 8
+
+/*
+ *  Structure: StreamResult
+ *  -----------------------
+ *  What the generator produced and saw in the queues
+ */
+typedef struct {
+    int arrivals;
+    // Arrivals lost because all N_CUS slots were taken
+    int rejected;
+    // Processes forked and already reaped by the generator
+    int forked;
+    int reaped;
+    // Detached customer threads started by the generator
+    int threads;
+    // Trend of the number of waiting customers in the second half of the stream
+    double growth_per_s;
+    int max_depth;
+    bool stable;
+} StreamResult;
+
+/*
+ *  Funtion: slot_acquire
+ *  ---------------------
+ *  Takes a free customer slot from the pool
+ *  Returns: the slot, 0 if all slots are taken
+ */
+int slot_acquire(Shared_memory *shm)
+{
+    if (lock_trywait(LOCK_FREE, &shm->sem_free) == -1) return 0;
+
+    lock_wait(LOCK_POOL, &shm->sem_pool);
+    int slot = shm->free_slots[--shm->free_top];
+    lock_post(LOCK_POOL, &shm->sem_pool);
+    return slot;
+}
+
+/*
+ *  Funtion: slot_release
+ *  ---------------------
+ *  Customer leaving the post returns its slot to the pool
+ */
+void slot_release(Shared_memory *shm, int slot)
+{
+    lock_wait(LOCK_POOL, &shm->sem_pool);
+    shm->free_slots[shm->free_top++] = slot;
+    lock_post(LOCK_POOL, &shm->sem_pool);
+    lock_post(LOCK_FREE, &shm->sem_free);
+}
+
+/*
+ *  Funtion: stream_interarrival
+ *  ----------------------------
+ *  Returns: exponentially distributed time to the next arrival
+ *           (of a burst in the bursty mode) in nanoseconds
+ */
+int64_t stream_interarrival(ProcessInfo *process_info)
+{
+    double rate = stream_arrivals == ARRIVALS_BURSTY ? stream_rate / STREAM_BURST : stream_rate;
+    return decision(process_info, DECISION_GAP, (int64_t)(-log(rng_unit(&process_info->rng)) / rate * 1e9));
+}
+
+/*
+ *  Funtion: stream_spawn
+ *  ---------------------
+ *  Starts a customer in the slot as a thread or a forked process,
+ *  the forked process returns with process_info of the customer
+ *  Returns: 0 (if the customer was started)
+ *           else (not)
+ */
+int stream_spawn(Shared_memory *shm, ProcessInfo *process_info, WorkerArgs *workers, int id, int slot)
+{
+    ProcessInfo customer_info;
+    process_info_init(&customer_info, ZAKAZNIK, id);
+    customer_info.slot = slot;
+
+    if (threads_mode)
+    {
+        WorkerArgs *w = &workers[slot - 1];
+        pthread_attr_t attr;
+        pthread_t thread;
+
+        w->process_info = customer_info;
+        w->time_limit = 0;
+        w->shm = shm;
+        w->late = true;
+
+        pthread_attr_init(&attr);
+        pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        int result = pthread_create(&thread, &attr, worker_thread, w);
+        pthread_attr_destroy(&attr);
+        return result != 0;
+    }
+
+    pid_t parent = getpid();
+    pid_t pid = fork();
+    if (pid == -1) return 1;
+    if (pid == 0) {
+        die_with_parent(parent);
+        *process_info = customer_info;
+    }
+    return 0;
+}
+
+/*
+ *  Funtion: stream_stability
+ *  -------------------------
+ *  Fits a line through the depth samples of the second half of the stream,
+ *  the queues are unstable if arrivals were lost or the fitted growth over
+ *  the second half exceeds what the officers hold on their desks
+ */
+void stream_stability(StreamResult *result, const int64_t *times, const int *depths, int samples, int NU)
+{
+    int first = samples / 2;
+    int n = samples - first;
+    double mean_t = 0, mean_d = 0, cov = 0, var = 0;
+
+    for (int i = first; i < samples; i++) {
+        mean_t += times[i] / 1e9 / n;
+        mean_d += (double)depths[i] / n;
+    }
+    for (int i = first; i < samples; i++) {
+        cov += (times[i] / 1e9 - mean_t) * (depths[i] - mean_d);
+        var += (times[i] / 1e9 - mean_t) * (times[i] / 1e9 - mean_t);
+    }
+
+    result->growth_per_s = n > 1 && var > 0 ? cov / var : 0.0;
+    double growth = n > 1 ? result->growth_per_s * (times[samples - 1] - times[first]) / 1e9 : 0.0;
+    result->stable = result->rejected == 0 && growth <= 2 * NU + 10;
+}
+
+/*
+ *  Funtion: stream_generate
+ *  ------------------------
+ *  Main process creates customers at the rate for the duration,
+ *  a forked customer returns from here with its process_info
+ */
+void stream_generate(Shared_memory *shm, ProcessInfo *process_info, WorkerArgs *workers,
+                     pid_t writer_pid, Autoscaler *as, StreamResult *result)
+{
+    static int64_t times[STREAM_SAMPLES];
+    static int depths[STREAM_SAMPLES];
+    int samples = 0;
+
+    int64_t start = now_ns();
+    int64_t end = start + (int64_t)stream_duration_ms * 1000000;
+    int64_t sample_step = (end - start) / STREAM_SAMPLES + 1;
+    int64_t next_sample = start;
+    int64_t next_arrival = start + stream_interarrival(process_info);
+
+    while (true)
+    {
+        int64_t now = now_ns();
+        if (now >= end) break;
+
+        autoscale(as, shm, process_info);
+        if (process_info->type != MAIN) return;
+
+        if (now >= next_sample && samples < STREAM_SAMPLES) {
+            int depth = atomic_load(&shm->waiting);
+            times[samples] = now - start;
+            depths[samples++] = depth;
+            if (depth > result->max_depth) result->max_depth = depth;
+            next_sample += sample_step;
+        }
+
+        if (now >= next_arrival)
+        {
+            int burst = 1;
+            if (stream_arrivals == ARRIVALS_BURSTY) {
+                burst = decision(process_info, DECISION_BURST, rng_below(&process_info->rng, 2 * STREAM_BURST - 1) + 1);
+            }
+            for (int i = 0; i < burst; i++)
+            {
+                int id = ++result->arrivals;
+                int slot = slot_acquire(shm);
+                if (slot == 0) {
+                    result->rejected++;
+                    continue;
+                }
+                if (stream_spawn(shm, process_info, workers, id, slot) != 0) {
+                    fprintf(stderr, "Failed to create customer %d\n", id);
+                    slot_release(shm, slot);
+                    result->rejected++;
+                    continue;
+                }
+                if (process_info->type != MAIN) return;
+                if (threads_mode) result->threads++;
+                else result->forked++;
+            }
+            next_arrival += stream_interarrival(process_info);
+            continue;
+        }
+
+        // Reaps the customers that are done, the writer must not exit
+        pid_t pid;
+        while (!threads_mode && (pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+            if (pid == writer_pid) fprintf(stderr, "Error: The log writer exited early\n");
+            else result->reaped++;
+        }
+
+        int64_t wake = next_arrival < next_sample ? next_arrival : next_sample;
+        if (as->max > as->min && as->next_ns < wake) wake = as->next_ns;
+        if (wake > end) wake = end;
+        if (wake > now) usleep((wake - now) / 1000);
+    }
+
+    stream_stability(result, times, depths, samples, as->active);
+    if (!result->stable) {
+        fprintf(stderr, "Warning: The queues are unstable at %.1f customers/s: %d of %d arrivals found no free slot,"
+                        " waiting customers grow by %.1f/s (max %d)\n",
+                stream_rate, result->rejected, result->arrivals, result->growth_per_s, result->max_depth);
+    }
+}
+
+/*
+ *  Funtion: server_start
+ *  ---------------------
+ *  Listens on the UNIX socket path, an old socket there is replaced,
+ *  and raises the limit of open files for thousands of clients
+ *  Returns: 0 (if the server listens)
+ *           else (not)
+ */
+int server_start(Server *s, const char *path, int num_slots)
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct stat st;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: The socket path %s is too long\n", path);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "Error: %s exists and is not a socket\n", path);
+            return 1;
+        }
+        unlink(path);
+    }
+
+    s->path = path;
+    s->clients = calloc(num_slots, sizeof(Client *));
+    s->called = malloc(num_slots * sizeof(int));
+    s->handling = malloc(num_slots * sizeof(int));
+    s->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    s->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    s->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (s->clients == NULL || s->called == NULL || s->handling == NULL
+        || s->listen_fd == -1 || s->epoll_fd == -1 || s->wake_fd == -1) {
+        fprintf(stderr, "Error: Failed to create the server\n");
+        return 1;
+    }
+    if (bind(s->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(s->listen_fd, SOMAXCONN) == -1) {
+        fprintf(stderr, "Error: Failed to listen on %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    // The listening socket and the eventfd are told apart by the address of their fd
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &s->listen_fd };
+    epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->listen_fd, &ev);
+    ev.data.ptr = &s->wake_fd;
+    epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->wake_fd, &ev);
+
+    pthread_mutex_init(&s->lock, NULL);
+    s->start_ns = now_ns();
+    server = s;
+    return 0;
+}
+
+/*
+ *  Funtion: server_reply
+ *  ---------------------
+ *  Sends an answer of the protocol, a client that cannot take
+ *  a few bytes is not waited for
+ */
+void server_reply(Client *c, const char *answer)
+{
+    if (c->fd != -1) {
+        ssize_t sent = send(c->fd, answer, strlen(answer), MSG_NOSIGNAL | MSG_DONTWAIT);
+        (void)sent;
+    }
+}
+
+/*
+ *  Funtion: server_finish
+ *  ----------------------
+ *  Closes the connection and gives its slot back, the client
+ *  is freed by server_free_finished after the batch of events
+ */
+void server_finish(Server *s, Shared_memory *shm, Client *c)
+{
+    if (c->fd != -1) close(c->fd);
+    c->fd = -1;
+    c->state = CLIENT_FINISHED;
+    decisions_flush(&c->process_info);
+    s->clients[c->process_info.slot - 1] = NULL;
+    slot_release(shm, c->process_info.slot);
+    c->next_finished = s->finished;
+    s->finished = c;
+}
+
+/*
+ *  Funtion: server_free_finished
+ *  -----------------------------
+ *  Frees the clients finished during a batch of events
+ */
+void server_free_finished(Server *s)
+{
+    while (s->finished != NULL) {
+        Client *c = s->finished;
+        s->finished = c->next_finished;
+        free(c);
+    }
+}
+
+/*
+ *  Funtion: server_accept
+ *  ----------------------
+ *  Takes all pending connections, each gets a free slot or BUSY
+ */
+void server_accept(Server *s, Shared_memory *shm)
+{
+    int fd;
+    while ((fd = accept(s->listen_fd, NULL, NULL)) != -1)
+    {
+        s->connections++;
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        int slot = slot_acquire(shm);
+        Client *c = slot == 0 ? NULL : calloc(1, sizeof(Client));
+        if (c == NULL) {
+            if (send(fd, SERVER_BUSY, strlen(SERVER_BUSY), MSG_NOSIGNAL | MSG_DONTWAIT) == -1) {
+                // The client is gone already
+            }
+            if (slot != 0) slot_release(shm, slot);
+            close(fd);
+            s->rejected++;
+            continue;
+        }
+
+        c->fd = fd;
+        c->state = CLIENT_CONNECTED;
+        c->process_info.slot = slot;
+        s->clients[slot - 1] = c;
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = c };
+        epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+/*
+ *  Funtion: server_enter
+ *  ---------------------
+ *  The customer of the client enters like in customer_visit,
+ *  or gets CLOSED and goes home
+ */
+void server_enter(Server *s, Shared_memory *shm, Client *c, int type_service)
+{
+    ProcessInfo *process_info = &c->process_info;
+    int slot = process_info->slot;
+    process_info_init(process_info, ZAKAZNIK, ++s->next_id);
+    process_info->slot = slot;
+    c->request_ns = now_ns();
+
+    if (!customer_enter(process_info, shm, type_service)) {
+        server_reply(c, SERVER_CLOSED);
+        s->answered++;
+        server_finish(s, shm, c);
+        return;
+    }
+    c->state = CLIENT_QUEUED;
+    s->queued++;
+}
+
+/*
+ *  Funtion: server_read
+ *  --------------------
+ *  Reads the request of a client, a queued client that hangs up
+ *  stays in its queue until called
+ */
+void server_read(Server *s, Shared_memory *shm, Client *c)
+{
+    // Finished earlier in the same batch, e.g. called after hanging up
+    if (c->state == CLIENT_FINISHED) return;
+
+    ssize_t n = read(c->fd, c->line + c->len, sizeof(c->line) - 1 - c->len);
+    if (n == -1 && (errno == EAGAIN || errno == EINTR)) return;
+
+    if (c->state == CLIENT_QUEUED) {
+        if (n <= 0) {
+            close(c->fd);
+            c->fd = -1;
+        }
+        return;
+    }
+    if (n <= 0) {
+        server_finish(s, shm, c);
+        return;
+    }
+
+    c->len += n;
+    c->line[c->len] = '\0';
+    if (strchr(c->line, '\n') == NULL) {
+        if (c->len < (int)sizeof(c->line) - 1) return;
+    }
+
+    char *end;
+    int type_service = -1;
+    if (strncmp(c->line, SERVER_ENTER " ", strlen(SERVER_ENTER) + 1) == 0) {
+        type_service = (int)strtol(c->line + strlen(SERVER_ENTER) + 1, &end, 10);
+        if (*end != '\n' && *end != '\r') type_service = -1;
+    }
+    if (type_service < 0 || type_service > service_types) {
+        server_reply(c, SERVER_ERROR);
+        server_finish(s, shm, c);
+        return;
+    }
+    server_enter(s, shm, c, type_service);
+}
+
+/*
+ *  Funtion: server_called
+ *  ----------------------
+ *  Customers called by the officers take the call like in
+ *  customer_visit, the client gets CALLED and the customer goes home
+ */
+void server_called(Server *s, Shared_memory *shm)
+{
+    uint64_t count;
+    if (read(s->wake_fd, &count, sizeof(count)) != sizeof(count)) return;
+
+    pthread_mutex_lock(&s->lock);
+    int num = s->num_called;
+    memcpy(s->handling, s->called, num * sizeof(int));
+    s->num_called = 0;
+    pthread_mutex_unlock(&s->lock);
+
+    for (int i = 0; i < num; i++)
+    {
+        Client *c = s->clients[s->handling[i] - 1];
+        CustomerSlot *slot = &shm->slots[s->handling[i] - 1];
+
+        lock_wait(LOCK_CALLED, &slot->sem_called);
+        write_log(shm, &c->process_info, LOG_CALLED, 0);
+        lock_post(LOCK_CALLING_BEFORE_DONE, &slot->sem_calling_before_done);
+
+        server_reply(c, SERVER_CALLED);
+        hist_record(&s->latency, now_ns() - c->request_ns);
+        s->answered++;
+        write_log(shm, &c->process_info, LOG_GOING_HOME, 0);
+        atomic_fetch_add(&shm->stats->customers_done, 1);
+        s->queued--;
+        server_finish(s, shm, c);
+    }
+}
+
+/*
+ *  Funtion: server_poll
+ *  --------------------
+ *  Handles the events of up to timeout_ms milliseconds
+ */
+void server_poll(Server *s, Shared_memory *shm, int timeout_ms)
+{
+    struct epoll_event events[256];
+    int n = epoll_wait(s->epoll_fd, events, 256, timeout_ms);
+
+    for (int i = 0; i < n; i++) {
+        if (events[i].data.ptr == &s->listen_fd) server_accept(s, shm);
+        else if (events[i].data.ptr == &s->wake_fd) server_called(s, shm);
+    }
+    // Clients last, those finished above are skipped and freed after the batch
+    for (int i = 0; i < n; i++) {
+        if (events[i].data.ptr != &s->listen_fd && events[i].data.ptr != &s->wake_fd) {
+            server_read(s, shm, events[i].data.ptr);
+        }
+    }
+    server_free_finished(s);
+}
+
+/*
+ *  Funtion: server_run
+ *  -------------------
+ *  Serves the clients while the post is open for the duration,
+ *  the autoscaler looks at the queues in between
+ */
+void server_run(Server *s, Shared_memory *shm, ProcessInfo *process_info, Autoscaler *as)
+{
+    int64_t end = now_ns() + (int64_t)stream_duration_ms * 1000000;
+    int64_t now;
+
+    while ((now = now_ns()) < end)
+    {
+        autoscale(as, shm, process_info);
+        int64_t wake = as->max > as->min && as->next_ns < end ? as->next_ns : end;
+        server_poll(s, shm, wake > now ? (int)((wake - now + 999999) / 1000000) : 0);
+    }
+}
+
+/*
+ *  Funtion: server_drain
+ *  ---------------------
+ *  After the closing serves the clients until nobody is queued
+ */
+void server_drain(Server *s, Shared_memory *shm)
+{
+    while (s->queued > 0) {
+        server_poll(s, shm, 10);
+    }
+}
+
+/*
+ *  Funtion: server_stop
+ *  --------------------
+ *  Closes the clients that never asked, the socket, and prints
+ *  the requests per second and the latency from a request to its answer
+ */
+void server_stop(Server *s, Shared_memory *shm, int num_slots)
+{
+    for (int i = 0; i < num_slots; i++) {
+        if (s->clients[i] != NULL) server_finish(s, shm, s->clients[i]);
+    }
+    server_free_finished(s);
+    close(s->listen_fd);
+    close(s->epoll_fd);
+    close(s->wake_fd);
+    unlink(s->path);
+
+    double wall_s = (now_ns() - s->start_ns) / 1e9;
+    fprintf(stderr, "Server %s: %d connections, %d busy, %d answered, %.0f requests/s,"
+                    " latency of CALLED p50 %.1f us, p99 %.1f us, max %.1f us\n",
+            s->path, s->connections, s->rejected, s->answered, wall_s > 0 ? s->answered / wall_s : 0.0,
+            hist_percentile(&s->latency, 50) / 1e3, hist_percentile(&s->latency, 99) / 1e3,
+            atomic_load(&s->latency.max) / 1e3);
+
+    pthread_mutex_destroy(&s->lock);
+    free(s->clients);
+    free(s->called);
+    free(s->handling);
+    server = NULL;
+}
+
+/*
+ *  Function: worker_thread
+ *  -----------------------
+ *  Entry point of a customer or officer thread
+ */
+void *worker_thread(void *arg)
+{
+    WorkerArgs *w = arg;
+
+    if (!w->late) mark_started(w->shm);
+    if (w->process_info.type == ZAKAZNIK) {
+        customer(&w->process_info, w->time_limit, w->shm);
+        if (stream_rate > 0) {
+            slot_release(w->shm, w->process_info.slot);
+            atomic_fetch_add(&stream_threads_done, 1);
+        }
+    } else {
+        urad(&w->process_info, w->time_limit, w->shm);
+    }
+    return NULL;
+}
+
+/*
+ *  Function: fiber_main
+ *  --------------------
+ *  Entry point of a customer fiber, returning
+ *  switches back to the event loop (uc_link)
+ */
+void fiber_main(void)
+{
+    FiberWorker *w = fiber_worker;
+    customer_visit(&w->current->process_info, w->shm);
+    decisions_flush(&w->current->process_info);
+    w->finished = true;
+}
+
+/*
+ *  Function: fiber_create
+ *  ----------------------
+ *  Fiber of an arriving customer on the stack of a finished one
+ *  or on the next unused stack of the region
+ *  Returns: the fiber
+ */
+Fiber *fiber_create(FiberWorker *w, ProcessInfo *process_info)
+{
+    Fiber *f = w->free_fibers;
+    if (f != NULL) w->free_fibers = f->next;
+    else f = (Fiber *)(w->stacks + (size_t)++w->stacks_used * FIBER_STACK_SIZE) - 1;
+
+    f->process_info = *process_info;
+    f->worker = w;
+    getcontext(&f->context);
+    f->context.uc_stack.ss_sp = (char *)(f + 1) - FIBER_STACK_SIZE;
+    f->context.uc_stack.ss_size = FIBER_STACK_SIZE - sizeof(Fiber);
+    f->context.uc_link = &w->scheduler;
+    makecontext(&f->context, fiber_main, 0);
+    return f;
+}
+
+/*
+ *  Function: fiber_worker_thread
+ *  -----------------------------
+ *  Event loop of a fiber worker, makes the fibers woken by the
+ *  officers and of the due timers ready and runs them until each
+ *  parks again or finishes, sleeps until the next timer otherwise
+ */
+void *fiber_worker_thread(void *arg)
+{
+    FiberWorker *w = arg;
+    fiber_worker = w;
+    lock_role = ZAKAZNIK;
+
+    while (w->remaining > 0)
+    {
+        pthread_mutex_lock(&w->lock);
+        Fiber *woken = w->woken;
+        w->woken = NULL;
+        pthread_mutex_unlock(&w->lock);
+        while (woken != NULL) {
+            Fiber *next = woken->next;
+            fiber_ready(w, woken);
+            woken = next;
+        }
+
+        // A timer without a fiber is the arrival of a customer, a limited
+        // number of them at once, so the stacks of arrivals are reused
+        // After the closing all timers are due, the customers go home at once
+        int64_t now = office_is_open(w->shm) ? now_ns() : INT64_MAX;
+        for (int i = 0; i < FIBER_BATCH && w->num_timers > 0 && w->timers[0].wake_ns <= now; i++) {
+            FiberTimer timer = fiber_timer_pop(w);
+            fiber_ready(w, timer.fiber != NULL ? timer.fiber : fiber_create(w, &w->arrivals[timer.arrival]));
+        }
+
+        if (w->ready_head == NULL)
+        {
+            pthread_mutex_lock(&w->lock);
+            if (w->woken == NULL && w->num_timers == 0) {
+                pthread_cond_wait(&w->wake, &w->lock);
+            } else if (w->woken == NULL && office_is_open(w->shm)) {
+                struct timespec until = { w->timers[0].wake_ns / 1000000000, w->timers[0].wake_ns % 1000000000 };
+                pthread_cond_timedwait(&w->wake, &w->lock, &until);
+            }
+            pthread_mutex_unlock(&w->lock);
+            continue;
+        }
+
+        // Fibers only get ready through the loop, the list ends
+        while (w->ready_head != NULL)
+        {
+            Fiber *f = w->ready_head;
+            w->ready_head = f->next;
+            if (w->ready_head == NULL) w->ready_tail = NULL;
+
+            w->current = f;
+            w->finished = false;
+            swapcontext(&w->scheduler, &f->context);
+            if (w->finished) {
+                f->next = w->free_fibers;
+                w->free_fibers = f;
+                w->remaining--;
+            }
+        }
+        w->current = NULL;
+    }
+    return NULL;
+}
+
+/*
+ *  Function: fibers_start
+ *  ----------------------
+ *  Starts fiber_workers worker threads, worker k gets the customers
+ *  k + 1, k + 1 + fiber_workers, ... as timers of their arrival,
+ *  the fibers are created when they arrive
+ *  Stacks are reserved for all customers of a worker without
+ *  guard pages, only the touched pages take memory
+ *  Returns: the workers, NULL on failure
+ */
+FiberWorker *fibers_start(int num_zakaznik, int TZ, Shared_memory *shm)
+{
+    FiberWorker *workers = aligned_calloc(fiber_workers, sizeof(FiberWorker));
+    if (workers == NULL) {
+        fprintf(stderr, "Error: Failed to allocate the fiber workers\n");
+        return NULL;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
+    pthread_condattr_t condattr;
+    pthread_condattr_init(&condattr);
+    pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+    int64_t start = now_ns();
+
+    for (int k = 0; k < fiber_workers; k++)
+    {
+        FiberWorker *w = &workers[k];
+        int customers = num_zakaznik / fiber_workers + (k < num_zakaznik % fiber_workers);
+        w->shm = shm;
+        w->remaining = customers;
+        w->timers = malloc((customers + 1) * sizeof(FiberTimer));
+        w->arrivals = malloc((customers + 1) * sizeof(ProcessInfo));
+        w->stacks = customers == 0 ? NULL : mmap(NULL, (size_t)customers * FIBER_STACK_SIZE, PROT_READ | PROT_WRITE,
+                                                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (w->timers == NULL || w->arrivals == NULL || w->stacks == MAP_FAILED) {
+            fprintf(stderr, "Error: Failed to allocate the stacks of %d fibers\n", customers);
+            return NULL;
+        }
+        pthread_mutex_init(&w->lock, NULL);
+        pthread_cond_init(&w->wake, &condattr);
+
+        for (int i = 0; i < customers; i++) {
+            ProcessInfo *process_info = &w->arrivals[i];
+            process_info_init(process_info, ZAKAZNIK, k + 1 + i * fiber_workers);
+            int64_t arrival = start + customer_arrival(process_info, TZ) * INT64_C(1000000);
+            fiber_timer_push(w, (FiberTimer){ arrival, NULL, i });
+        }
+
+        if (pthread_create(&w->thread, &attr, fiber_worker_thread, w) != 0) {
+            fprintf(stderr, "Failed to create fiber worker %d\n", k + 1);
+            return NULL;
+        }
+    }
+    pthread_condattr_destroy(&condattr);
+    pthread_attr_destroy(&attr);
+    return workers;
+}
+
+/*
+ *  Function: fibers_close
+ *  ----------------------
+ *  Wakes up the fiber workers sleeping until their next timer
+ *  after the closing of the post
+ */
+void fibers_close(FiberWorker *workers)
+{
+    for (int k = 0; k < fiber_workers; k++) {
+        pthread_mutex_lock(&workers[k].lock);
+        pthread_cond_signal(&workers[k].wake);
+        pthread_mutex_unlock(&workers[k].lock);
+    }
+}
+
+/*
+ *  Function: fibers_join
+ *  ---------------------
+ *  Waits for the fiber workers and frees them
+ */
+void fibers_join(FiberWorker *workers, int num_zakaznik)
+{
+    for (int k = 0; k < fiber_workers; k++)
+    {
+        FiberWorker *w = &workers[k];
+        int customers = num_zakaznik / fiber_workers + (k < num_zakaznik % fiber_workers);
+        pthread_join(w->thread, NULL);
+        if (w->stacks != NULL) munmap(w->stacks, (size_t)customers * FIBER_STACK_SIZE);
+        free(w->timers);
+        free(w->arrivals);
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->wake);
+    }
+    free(workers);
+}
+
+/*
+ *  ________VIRTUAL TIME SIMULATION__________
+ *  The same post office state machine driven by
+ *  a priority queue of events on a simulated clock
+ *  (in microseconds) instead of sleeping processes
+ */
+
+typedef enum {
+    VT_CUSTOMER_ARRIVAL,
+    VT_CUSTOMER_LEAVE,
+    VT_OFFICER_START,
+    VT_OFFICER_WAKE,
+    VT_SERVICE_DONE,
+    VT_BREAK_DONE,
+    VT_CLOSING
+} VirtualEventType;
+
+/*
+ *  Structure: VirtualEvent
+ *  -----------------------
+ *  Event of the virtual time simulation
+ *  Events with the same time are ordered by creation
+ */
+typedef struct {
+    int64_t time;
+    uint64_t order;
+    VirtualEventType type;
+    int id;
+} VirtualEvent;
+
+/*
+ *  Structure: VirtualOffice
+ *  ------------------------
+ *  State of the virtual time simulation
+ */
+typedef struct {
+    VirtualEvent *heap;
+    int heap_size;
+    uint64_t next_order;
+    LaneSet queues;
+    int *idle;
+    int num_idle;
+    int64_t *enter_time;
+    int64_t *service_start;
+    int *service_type;
+    int *next_lane;
+    int *batch;
+    int *batch_next;
+    int *batch_count;
+    Histogram *wait_hist;
+    Histogram *service_hist;
+    OfficerStats *officers;
+    int turned_away;
+    bool open;
+    int TU;
+    Rng rng;
+    uint64_t cislo_vypisu;
+    FILE *f;
+    // Time of the event being processed
+    int64_t now;
+} VirtualOffice;
+
+/*
+ *  Function: vt_earlier
+ *  --------------------
+ *  Returns: true (if event a comes before event b)
+ */
+bool vt_earlier(const VirtualEvent *a, const VirtualEvent *b)
+{
+    return a->time < b->time || (a->time == b->time && a->order < b->order);
+}
 
-            exit_closed_entrance(shm, process_info, f);
+/*
+ *  Function: vt_push
+ *  -----------------
+ *  Schedules an event, the heap is sized for the worst case
+ */
+void vt_push(VirtualOffice *vo, int64_t time, VirtualEventType type, int id)
+{
+    VirtualEvent e = { time, vo->next_order++, type, id };
+    int i = vo->heap_size++;
 
-            // Enter post office if not closed
-            shm->num_money++;
-            fprintf(f, "%d: Z %d: entering office for a service %d\n", shm->cislo_vypisu, process_info->id, type_service);
-            fflush(f);
-            shm->cislo_vypisu++;
+    while (i > 0 && vt_earlier(&e, &vo->heap[(i - 1) / 2])) {
+        vo->heap[i] = vo->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    vo->heap[i] = e;
+}
 
-            sem_post(&shm->sem_writing);
+/*
+ *  Function: vt_pop
+ *  ----------------
+ *  Removes the earliest event
+ */
+VirtualEvent vt_pop(VirtualOffice *vo)
+{
+    VirtualEvent top = vo->heap[0];
+    VirtualEvent last = vo->heap[--vo->heap_size];
+    int i = 0;
 
-            sem_post(&shm->sem_post_office);
+    while (true) {
+        int child = 2 * i + 1;
+        if (child >= vo->heap_size) break;
+        if (child + 1 < vo->heap_size && vt_earlier(&vo->heap[child + 1], &vo->heap[child])) child++;
+        if (!vt_earlier(&vo->heap[child], &last)) break;
+        vo->heap[i] = vo->heap[child];
+        i = child;
+    }
+    vo->heap[i] = last;
+    return top;
+}
 
-            // Give signal that someone is waiting in the queue with packages
-            sem_wait(&shm->sem_money);
+/*
+ *  Function: vt_log
+ *  ----------------
+ *  Writes a log line in the proj2.out format
+ */
+void vt_log(VirtualOffice *vo, ProcessType type, int id, LogEvent event, int service)
+{
+    char line[LOG_LINE_MAX];
+    LogRecord r = { .time_ns = vo->now * 1000, .id = id, .type = type, .event = event, .service = service };
 
-            write_log(shm, "Z", process_info, "called by office worker", f);
-            // Synchronization called by office worker and service finished
-            sem_post(&shm->sem_calling_before_done);
-		    break;
-		default:
-			break;
-	}
+    int len = binary_log ? binary_log_record(line, vo->cislo_vypisu++, &r)
+                         : format_log_record(line, vo->cislo_vypisu++, &r);
+    fwrite(line, 1, len, vo->f);
+}
 
-    srand(time(NULL) *getpid());
-    int customer_wait = rand() % 11;
-    usleep(customer_wait);
-    write_log(shm, "Z", process_info, "going home", f);
+/*
+ *  Function: vt_queues_empty
+ *  -------------------------
+ *  Returns: true (if nobody is waiting in any queue)
+ */
+bool vt_queues_empty(VirtualOffice *vo)
+{
+    return lane_next_set(&vo->queues, 0) < 0;
 }
 
 /*
- *  Function: urad
- *  ------------------
- *  Life cycle of a office worker
- *  Provides synchronization between processes
+ *  Function: vt_officer_step
+ *  -------------------------
+ *  Officer serves the next customer of its batch, when the batch
+ *  is done picks a queue by the same scheduler as urad() and takes
+ *  a new one, or decides about a break
  */
-void urad(ProcessInfo* process_info, int TU, Shared_memory *shm, FILE* f)
+void vt_officer_step(VirtualOffice *vo, int officer, int64_t now)
 {
-    srand(time(NULL) *getpid());
+    int *batch = &vo->batch[(officer - 1) * batch_size];
+    int type_service = vo->service_type[officer - 1];
 
-    write_log(shm, "U", process_info, "started", f);
-    while(true)
+    // A new batch of customers from the queue chosen by the scheduler
+    if (vo->batch_next[officer - 1] == vo->batch_count[officer - 1])
     {
-        sem_wait(&shm->sem_post_office);
-        int order_of_lanes = (random() % 3) + 1;
-        int type_service = 1;
+        type_service = scheduler->pick(&vo->queues, &vo->rng, &vo->next_lane[officer - 1]);
+        int count = 0;
 
-        // Provides REAL RANDOMIZATION of post officer's choice of queue order
-        switch(order_of_lanes)
+        if (type_service != 0)
         {
-            case 1:  
-                if(shm->num_letters > 0)
-                {
-                    sem_wait(&shm->sem_writing);
+            Lane *lane = &vo->queues.lanes[type_service - 1];
+            while (count < batch_size && lane->head != lane->tail) {
+                batch[count++] = lane_pop(&vo->queues, type_service);
+            }
+            if (lane->head != lane->tail) {
+                atomic_store(&lane->head_enter_ns, vo->enter_time[lane->ids[lane->head] - 1]);
+            }
+        }
+        vo->batch_next[officer - 1] = 0;
+        vo->batch_count[officer - 1] = count;
+    }
 
-                    // Taking one requirement from letters queue
-                    type_service = 1;
-                    fprintf(f, "%d: U %d: serving a service of type %d\n", shm->cislo_vypisu, process_info->id, type_service);
-                    fflush(f);
-                    shm->cislo_vypisu++;
+    if (vo->batch_next[officer - 1] < vo->batch_count[officer - 1])
+    {
+        int zakaznik = batch[vo->batch_next[officer - 1]++];
 
-                    sem_post(&shm->sem_writing);
-                    shm->num_letters--;
+        hist_record(&vo->wait_hist[type_service - 1], (now - vo->enter_time[zakaznik - 1]) * 1000);
+        vo->service_start[officer - 1] = now;
+        vo->service_type[officer - 1] = type_service;
+        vt_log(vo, URADNIK, officer, LOG_SERVING, type_service);
+        atomic_fetch_add(&vo->officers[officer - 1].served, 1);
+        vt_log(vo, ZAKAZNIK, zakaznik, LOG_CALLED, 0);
 
-                    sem_post(&shm->sem_letters);
+        vt_push(vo, now + rng_below(&vo->rng, 11), VT_CUSTOMER_LEAVE, zakaznik);
+        vt_push(vo, now + rng_below(&vo->rng, 11), VT_SERVICE_DONE, officer);
+        return;
+    }
 
-                    // Synchronization called by office worker and service finished
-                    sem_wait(&shm->sem_calling_before_done);
+    // Nothing to serve, going home after closing or taking break
+    if (!vo->open) {
+        vt_log(vo, URADNIK, officer, LOG_GOING_HOME, 0);
+        return;
+    }
+    vt_log(vo, URADNIK, officer, LOG_TAKING_BREAK, 0);
+    atomic_fetch_add(&vo->officers[officer - 1].breaks, 1);
+    vt_push(vo, now + (int64_t)rng_below(&vo->rng, vo->TU + 1) * 1000, VT_BREAK_DONE, officer);
+}
 
-                    officer_wait_before_task_done();
-                    write_log(shm, "U", process_info, "service finished", f);
-                }
-                else if(shm->num_packages > 0)
-                {
-                    sem_wait(&shm->sem_writing);
+/*
+ *  Function: vt_officer_wait
+ *  -------------------------
+ *  Officer after a break serves a waiting customer,
+ *  goes home after closing or sleeps until someone enters
+ */
+void vt_officer_wait(VirtualOffice *vo, int officer, int64_t now)
+{
+    if (!vt_queues_empty(vo)) {
+        vt_officer_step(vo, officer, now);
+    } else if (!vo->open) {
+        vt_log(vo, URADNIK, officer, LOG_GOING_HOME, 0);
+    } else {
+        vo->idle[vo->num_idle++] = officer;
+    }
+}
 
-                    // Taking one requirement from packages queue
-                    type_service = 2;
-                    fprintf(f, "%d: U %d: serving a service of type %d\n", shm->cislo_vypisu, process_info->id, type_service);
-                    fflush(f);
-                    shm->cislo_vypisu++;
+/*
+ *  Function: vt_customer_arrival
+ *  -----------------------------
+ *  Customer enters the post office or goes home
+ */
+void vt_customer_arrival(VirtualOffice *vo, int zakaznik, int64_t now)
+{
+    vt_log(vo, ZAKAZNIK, zakaznik, LOG_STARTED, 0);
 
-                    sem_post(&shm->sem_writing);
-                    shm->num_packages--;
+    if (!vo->open) {
+        vo->turned_away++;
+        vt_log(vo, ZAKAZNIK, zakaznik, LOG_GOING_HOME, 0);
+        return;
+    }
 
-                    sem_post(&shm->sem_packages);
+    int type_service = rng_below(&vo->rng, service_types) + 1;
 
-                    // Synchronization called by office worker and service finished
-                    sem_wait(&shm->sem_calling_before_done);
+    vt_log(vo, ZAKAZNIK, zakaznik, LOG_ENTERING, type_service);
+    vo->enter_time[zakaznik - 1] = now;
+    lane_push(&vo->queues, type_service, zakaznik, now);
 
-                    officer_wait_before_task_done();
-                    write_log(shm, "U", process_info, "service finished", f);
-                }
-                else if(shm->num_money > 0)
-                {
-                    sem_wait(&shm->sem_writing);
+    // Wakes up an officer
+    if (vo->num_idle > 0) {
+        vt_push(vo, now, VT_OFFICER_WAKE, vo->idle[--vo->num_idle]);
+    }
+}
 
-                    // Taking one requirement from money queue
-                    type_service = 3;
-                    fprintf(f, "%d: U %d: serving a service of type %d\n", shm->cislo_vypisu, process_info->id, type_service);
-                    fflush(f);
-                    shm->cislo_vypisu++;
+/*
+ *  Function: virtual_time_simulation
+ *  ---------------------------------
+ *  Runs the whole simulation on the virtual clock,
+ *  records the times into the histograms
+ *  Returns: number of turned away customers
+ *           -1 (if the simulation failed)
+ */
+int virtual_time_simulation(int NZ, int NU, int TZ, int TU, int F, FILE* f, Histogram *wait_hist, Histogram *service_hist,
+                            OfficerStats *officers)
+{
+    VirtualOffice vo = { .open = true, .TU = TU, .cislo_vypisu = 1, .f = f,
+                         .wait_hist = wait_hist, .service_hist = service_hist, .officers = officers };
+    rng_seed(&vo.rng, MAIN, 0);
 
-                    sem_post(&shm->sem_writing);
-                    shm->num_money--;
+    // Every customer and officer has at most one pending event
+    vo.heap = malloc((NZ + NU + 1) * sizeof(VirtualEvent));
+    vo.idle = malloc((NU + 1) * sizeof(int));
+    vo.enter_time = malloc((NZ + 1) * sizeof(int64_t));
+    vo.service_start = malloc((NU + 1) * sizeof(int64_t));
+    vo.service_type = malloc((NU + 1) * sizeof(int));
+    vo.next_lane = malloc((NU + 1) * sizeof(int));
+    vo.batch = malloc(((size_t)NU * batch_size + 1) * sizeof(int));
+    vo.batch_next = calloc(NU + 1, sizeof(int));
+    vo.batch_count = calloc(NU + 1, sizeof(int));
+    bool allocated = vo.heap != NULL && vo.idle != NULL && vo.enter_time != NULL
+                     && vo.service_start != NULL && vo.service_type != NULL && vo.next_lane != NULL
+                     && vo.batch != NULL && vo.batch_next != NULL && vo.batch_count != NULL;
+    vo.queues.count = service_types;
+    vo.queues.lanes = aligned_calloc(service_types, sizeof(Lane));
+    vo.queues.bitmap = calloc((service_types + 63) / 64, sizeof(uint64_t));
+    allocated = allocated && vo.queues.lanes != NULL && vo.queues.bitmap != NULL;
+    for (int i = 0; allocated && i < service_types; i++) {
+        vo.queues.lanes[i].ids = malloc((NZ + 1) * sizeof(int));
+        vo.queues.lanes[i].capacity = NZ + 1;
+        atomic_init(&vo.queues.lanes[i].head_enter_ns, INT64_MAX);
+        allocated = vo.queues.lanes[i].ids != NULL;
+    }
+    if (!allocated) {
+        fprintf(stderr, "Error: Failed to allocate the virtual time simulation\n");
+        return -1;
+    }
 
-                    sem_post(&shm->sem_money);
+    static char buf[1 << 20];
+    setvbuf(f, buf, _IOFBF, sizeof(buf));
 
-                    // Synchronization called by office worker and service finished
-                    sem_wait(&shm->sem_calling_before_done);
+    for (int i = 1; i <= NU; i++) {
+        vo.next_lane[i - 1] = (i - 1) % service_types;
+        vt_push(&vo, 0, VT_OFFICER_START, i);
+    }
+    for (int i = 1; i <= NZ; i++) {
+        vt_push(&vo, (int64_t)rng_below(&vo.rng, TZ + 1) * 1000, VT_CUSTOMER_ARRIVAL, i);
+    }
+    vt_push(&vo, (int64_t)(rng_below(&vo.rng, (F/2) + 1) + (F/2)) * 1000, VT_CLOSING, 0);
 
-                    officer_wait_before_task_done();
-                    write_log(shm, "U", process_info, "service finished", f);
+    while (vo.heap_size > 0)
+    {
+        VirtualEvent e = vt_pop(&vo);
+        vo.now = e.time;
+        switch(e.type)
+        {
+            case VT_CUSTOMER_ARRIVAL:
+                vt_customer_arrival(&vo, e.id, e.time);
+                break;
+            case VT_CUSTOMER_LEAVE:
+                vt_log(&vo, ZAKAZNIK, e.id, LOG_GOING_HOME, 0);
+                break;
+            case VT_OFFICER_START:
+                vt_log(&vo, URADNIK, e.id, LOG_STARTED, 0);
+                vt_officer_step(&vo, e.id, e.time);
+                break;
+            case VT_SERVICE_DONE:
+                hist_record(&vo.service_hist[vo.service_type[e.id - 1] - 1], (e.time - vo.service_start[e.id - 1]) * 1000);
+                vt_log(&vo, URADNIK, e.id, LOG_SERVICE_FINISHED, 0);
+                if (!vo.open && vt_queues_empty(&vo) && vo.batch_next[e.id - 1] == vo.batch_count[e.id - 1]) {
+                    vt_log(&vo, URADNIK, e.id, LOG_GOING_HOME, 0);
+                } else {
+                    vt_officer_step(&vo, e.id, e.time);
                 }
                 break;
-            case 2:  
-                if(shm->num_packages > 0)
-                {   
-                    sem_wait(&shm->sem_writing);
-
-                    // Taking one requirement from packages queue
-                    type_service = 2;
-                    fprintf(f, "%d: U %d: serving a service of type %d\n", shm->cislo_vypisu, process_info->id, type_service);
-                    fflush(f);
-                    shm->cislo_vypisu++;
-
-                    sem_post(&shm->sem_writing);
-                    shm->num_packages--;
-
-                    sem_post(&shm->sem_packages);
-
-                    // Synchronization called by office worker and service finished
-                    sem_wait(&shm->sem_calling_before_done);
+            case VT_BREAK_DONE:
+                vt_log(&vo, URADNIK, e.id, LOG_BREAK_FINISHED, 0);
+                vt_officer_wait(&vo, e.id, e.time);
+                break;
+            case VT_OFFICER_WAKE:
+                vt_officer_wait(&vo, e.id, e.time);
+                break;
+            case VT_CLOSING:
+                vo.open = false;
+                vt_log(&vo, MAIN, 0, LOG_CLOSING, 0);
 
-                    officer_wait_before_task_done();
-                    write_log(shm, "U", process_info, "service finished", f);
+                // Wakes up the waiting officers
+                while (vo.num_idle > 0) {
+                    vt_push(&vo, e.time, VT_OFFICER_WAKE, vo.idle[--vo.num_idle]);
                 }
-                else if(shm->num_money > 0)
-                {   
-                    sem_wait(&shm->sem_writing);
-
-                    // Taking one requirement from money queue
-                    type_service = 3;
-                    fprintf(f, "%d: U %d: serving a service of type %d\n", shm->cislo_vypisu, process_info->id, type_service);
-                    fflush(f);
-                    shm->cislo_vypisu++;
-
-                    sem_post(&shm->sem_writing);
-                    shm->num_money--;
+                break;
+        }
+    }
 
-                    sem_post(&shm->sem_money);
+    free(vo.heap);
+    free(vo.idle);
+    free(vo.enter_time);
+    free(vo.service_start);
+    free(vo.service_type);
+    free(vo.next_lane);
+    free(vo.batch);
+    free(vo.batch_next);
+    free(vo.batch_count);
+    for (int i = 0; vo.queues.lanes != NULL && i < service_types; i++) {
+        free(vo.queues.lanes[i].ids);
+    }
+    free(vo.queues.lanes);
+    free((void *)vo.queues.bitmap);
+    return vo.turned_away;
+}
 
-                    // Synchronization called by office worker and service finished
-                    sem_wait(&shm->sem_calling_before_done);
+/***    MAIN    ***/
+int main(int argc,char *argv[])
+{
+    static struct option long_options[] = {
+        {"threads", no_argument, NULL, 't'},
+        {"fibers", optional_argument, NULL, 'f'},
+        {"virtual-time", no_argument, NULL, 'v'},
+        {"report", required_argument, NULL, 'r'},
+        {"histograms", optional_argument, NULL, 'h'},
+        {"policy", required_argument, NULL, 'p'},
+        {"weights", required_argument, NULL, 'w'},
+        {"services", required_argument, NULL, 's'},
+        {"batch", required_argument, NULL, 'b'},
+        {"rate", required_argument, NULL, 'R'},
+        {"duration", required_argument, NULL, 'd'},
+        {"arrivals", required_argument, NULL, 'a'},
+        {"max-officers", required_argument, NULL, 'm'},
+        {"lock-profile", optional_argument, NULL, 'L'},
+        {"binary-log", no_argument, NULL, 'B'},
+        {"scale-depth", required_argument, NULL, 'D'},
+        {"scale-wait", required_argument, NULL, 'W'},
+        {"seed", required_argument, NULL, 'S'},
+        {"record", required_argument, NULL, 'C'},
+        {"replay", required_argument, NULL, 'Y'},
+        {"server", required_argument, NULL, 'X'},
+        {"officer-cpus", required_argument, NULL, 'O'},
+        {"customer-cpus", required_argument, NULL, 'Z'},
+        {"numa", no_argument, NULL, 'N'},
+        {"log-buffer", required_argument, NULL, 'l'},
+        {"log-flush-ms", required_argument, NULL, 'F'},
+        {NULL, 0, NULL, 0}
+    };
 
-                    officer_wait_before_task_done();
-                    write_log(shm, "U", process_info, "service finished", f);
+    int64_t start_ns = now_ns();
+    scheduler = &schedulers[0];
+    char* str;
+    bool virtual_time = false;
+    const char *report_path = NULL;
+    const char *hist_path = NULL;
+    const char *lock_profile_path = NULL;
+    const char *weights = NULL;
+    const char *record_path = NULL;
+    const char *replay_path = NULL;
+    const char *server_path = NULL;
+    const char *officer_cpu_list = NULL;
+    const char *customer_cpu_list = NULL;
+    bool numa = false;
+    bool seed_given = false;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1)
+    {
+        switch(opt)
+        {
+            case 't':
+                threads_mode = true;
+                break;
+            case 'f':
+                // The officers of the fiber mode are threads
+                threads_mode = true;
+                fiber_workers = sysconf(_SC_NPROCESSORS_ONLN);
+                if (optarg != NULL) {
+                    fiber_workers = (int)strtol(optarg, &str, 0);
+                    not_number_input(str);
                 }
-                else if(shm->num_letters > 0)
-                {
-                    sem_wait(&shm->sem_writing);
-
-                    // Taking one requirement from letters queue
-                    type_service = 1;
-                    fprintf(f, "%d: U %d: serving a service of type %d\n", shm->cislo_vypisu, process_info->id, type_service);
-                    fflush(f);
-                    shm->cislo_vypisu++;
-
-                    sem_post(&shm->sem_writing);
-                    shm->num_letters--;
-
-                    sem_post(&shm->sem_letters);
-
-                    // Synchronization called by office worker and service finished
-                    sem_wait(&shm->sem_calling_before_done);
-
-                    officer_wait_before_task_done();
-                    write_log(shm, "U", process_info, "service finished", f);
+                check_time_range_included(fiber_workers, 1, MAX_FIBER_WORKERS);
+                break;
+            case 'v':
+                virtual_time = true;
+                break;
+            case 'r':
+                report_path = optarg;
+                break;
+            case 'h':
+                hist_path = optarg != NULL ? optarg : "-";
+                break;
+            case 'L':
+                lock_profile_path = optarg != NULL ? optarg : "-";
+                break;
+            case 'B':
+                binary_log = true;
+                break;
+            case 'p':
+                scheduler = find_scheduler(optarg);
+                if (scheduler == NULL) {
+                    fprintf(stderr, "Unknown policy %s (random, longest, oldest, round-robin, weighted)\n", optarg);
+                    exit(1);
                 }
                 break;
-            case 3:  
-                if(shm->num_money > 0)
-                {   
-                    sem_wait(&shm->sem_writing);
-
-                    // Taking one requirement from money queue
-                    type_service = 3;
-                    fprintf(f, "%d: U %d: serving a service of type %d\n", shm->cislo_vypisu, process_info->id, type_service);
-                    fflush(f);
-                    shm->cislo_vypisu++;
-
-                    sem_post(&shm->sem_writing);
-                    shm->num_money--;
-
-                    sem_post(&shm->sem_money);
-
-                    // Synchronization called by office worker and service finished
-                    sem_wait(&shm->sem_calling_before_done);
-
-                    officer_wait_before_task_done();
-                    write_log(shm, "U", process_info, "service finished", f);
+            case 'w':
+                weights = optarg;
+                break;
+            case 's':
+                service_types = (int)strtol(optarg, &str, 0);
+                not_number_input(str);
+                check_time_range_included(service_types, 1, MAX_SERVICE_TYPES);
+                break;
+            case 'b':
+                batch_size = (int)strtol(optarg, &str, 0);
+                not_number_input(str);
+                check_time_range_included(batch_size, 1, MAX_BATCH);
+                break;
+            case 'R':
+                stream_rate = strtod(optarg, &str);
+                not_number_input(str);
+                if (stream_rate < 0 || stream_rate > MAX_STREAM_RATE) {
+                    fprintf(stderr, "Argument value is out of the range\n");
+                    exit(1);
                 }
-                else if(shm->num_letters > 0)
-                {   
-                    sem_wait(&shm->sem_writing);
-
-                    // Taking one requirmenent from letters queue
-                    type_service = 1;
-                    fprintf(f, "%d: U %d: serving a service of type %d\n", shm->cislo_vypisu, process_info->id, type_service);
-                    fflush(f);
-                    shm->cislo_vypisu++;
-
-                    sem_post(&shm->sem_writing);
-                    shm->num_letters--;
-
-                    sem_post(&shm->sem_letters);
-
-                    // Synchronization called by office worker and service finished 
-                    sem_wait(&shm->sem_calling_before_done);
-
-                    officer_wait_before_task_done();
-                    write_log(shm, "U", process_info, "service finished", f);
+                break;
+            case 'd':
+                stream_duration_ms = (int)strtol(optarg, &str, 0);
+                not_number_input(str);
+                check_time_range_included(stream_duration_ms, 0, MAX_STREAM_DURATION);
+                break;
+            case 'a':
+                if (strcmp(optarg, "poisson") == 0) stream_arrivals = ARRIVALS_POISSON;
+                else if (strcmp(optarg, "bursty") == 0) stream_arrivals = ARRIVALS_BURSTY;
+                else {
+                    fprintf(stderr, "Unknown arrivals %s (poisson, bursty)\n", optarg);
+                    exit(1);
                 }
-                else if(shm->num_packages > 0)
-                {   
-                    sem_wait(&shm->sem_writing);
-
-                    //Taking one requirement from packages queue
-                    type_service = 2;
-                    fprintf(f, "%d: U %d: serving a service of type %d\n", shm->cislo_vypisu, process_info->id, type_service);
-                    fflush(f);
-                    shm->cislo_vypisu++;
-
-                    sem_post(&shm->sem_writing);
-                    shm->num_packages--;
-
-                    sem_post(&shm->sem_packages);
-
-                    // Synchronization called by office worker and service finished
-                    sem_wait(&shm->sem_calling_before_done);
-
-                    officer_wait_before_task_done();
-                    write_log(shm, "U", process_info, "service finished", f);
+                break;
+            case 'm':
+                max_officers = (int)strtol(optarg, &str, 0);
+                not_number_input(str);
+                check_time_range_included(max_officers, 0, MAX_OFFICERS);
+                break;
+            case 'D':
+                scale_depth = (int)strtol(optarg, &str, 0);
+                not_number_input(str);
+                check_time_range_included(scale_depth, 1, 1000000);
+                break;
+            case 'W':
+                scale_wait_ms = (int)strtol(optarg, &str, 0);
+                not_number_input(str);
+                check_time_range_included(scale_wait_ms, 0, 10000);
+                break;
+            case 'S':
+                run_seed = strtoull(optarg, &str, 0);
+                not_number_input(str);
+                seed_given = true;
+                break;
+            case 'C':
+                record_path = optarg;
+                break;
+            case 'Y':
+                replay_path = optarg;
+                break;
+            case 'X':
+                // The officers of the server mode are threads
+                threads_mode = true;
+                server_path = optarg;
+                break;
+            case 'O':
+                officer_cpu_list = optarg;
+                break;
+            case 'Z':
+                customer_cpu_list = optarg;
+                break;
+            case 'N':
+                numa = true;
+                break;
+            case 'l':
+                log_buffer_size = strtoul(optarg, &str, 0);
+                not_number_input(str);
+                if (log_buffer_size < 4096 || log_buffer_size > LOG_BUFFER_MAX) {
+                    fprintf(stderr, "Argument value is out of the range\n");
+                    exit(1);
                 }
                 break;
-            default:
+            case 'F':
+                log_flush_ms = (int)strtol(optarg, &str, 0);
+                not_number_input(str);
+                check_time_range_included(log_flush_ms, 0, 10000);
                 break;
-        }
-
-        sem_post(&shm->sem_post_office);
-        
-        // Office worker is going home when the post is closed and all requirement are done
-        if(shm->num_letters == 0 && shm->num_packages == 0 && shm->num_money == 0 && shm -> open == false)
-        {
-            break;
-        }
-
-        // Office worker is taking break when nobody is waiting in queue and the post is opened
-        if(shm->num_letters == 0 && shm->num_packages == 0 && shm->num_money == 0)
-        {
-            write_log(shm, "U", process_info, "taking break", f);
-
-            int time_uradnik = random() % (TU + 1);
-            usleep(time_uradnik * 1000);
-
-            write_log(shm, "U", process_info, "break finished", f);
+            default:
+                fprintf(stderr, "Usage: %s [--threads | --fibers[=W] | --virtual-time] [--report=FILE] [--histograms[=FILE]]"
+                                " [--lock-profile[=FILE]] [--binary-log] [--policy=NAME] [--weights=W1,W2,...] [--services=N] [--batch=K]"
+                                " [--rate=R [--duration=MS] [--arrivals=poisson|bursty]]"
+                                " [--max-officers=M [--scale-depth=D] [--scale-wait=MS]]"
+                                " [--seed=S] [--record=FILE | --replay=FILE] [--server=PATH [--duration=MS]]"
+                                " [--officer-cpus=LIST] [--customer-cpus=LIST] [--numa] [--log-buffer=BYTES] [--log-flush-ms=MS]"
+                                " N_CUS N_OFF T_CUS T_OFF F\n", argv[0]);
+                exit(1);
         }
     }
 
-    write_log(shm, "U", process_info, "going home", f);
-}
-
-/***    MAIN    ***/
-int main(int argc,char *argv[])
-{
-    // Seed the random number generator with the current time and a process ID
-    srand(time(NULL) *getpid());
+    // Weights depend on the number of services
+    for (int i = 0; i < service_types; i++) {
+        service_weights[i] = 1;
+    }
+    if (weights != NULL && parse_weights(weights) != 0) {
+        fprintf(stderr, "Invalid weights %s, expected %d positive numbers separated by commas\n", weights, service_types);
+        exit(1);
+    }
 
-    if (argc != 6){
+    if (argc - optind != 5){
         fprintf(stderr, "Invalid number of arguments\n");
         exit(-1);
     }
@@ -549,88 +4426,342 @@ int main(int argc,char *argv[])
     int NU; // Number of office workers
     int TZ, TU, F; // Times
 
-    char* str;
+    char** args = &argv[optind];
 
     // Checking numbers of child processes, if they are numbers
-    NZ = (int)strtol(argv[1], &str, 0);
+    NZ = (int)strtol(args[0], &str, 0);
     not_number_input(str);
-    NU = (int)strtol(argv[2], &str, 0);
+    NU = (int)strtol(args[1], &str, 0);
     not_number_input(str);
 
     // Checking range of time input arguments and if they are numbers
-    check_time_range_included(TZ = (int)strtol(argv[3], &str, 0), 0, 10000);
+    check_time_range_included(TZ = (int)strtol(args[2], &str, 0), 0, 10000);
     not_number_input(str);
-    check_time_range_included(TU = (int)strtol(argv[4], &str, 0), 0 , 100);
+    check_time_range_included(TU = (int)strtol(args[3], &str, 0), 0 , 100);
     not_number_input(str);
-    check_time_range_included(F = (int)strtol(argv[5], &str, 0), 0, 10000);
+    check_time_range_included(F = (int)strtol(args[4], &str, 0), 0, 10000);
     not_number_input(str);
 
+    // Fibers are the customers of N_CUS, at most one worker per customer
+    if (fiber_workers > 0 && (virtual_time || stream_rate > 0)) {
+        fprintf(stderr, "Error: --fibers is not supported with --virtual-time or --rate\n");
+        exit(1);
+    }
+    if (fiber_workers > NZ && NZ > 0) fiber_workers = NZ;
+
+    // The streaming mode runs in real time, the customers of N_CUS are the slots
+    if (stream_rate > 0 && virtual_time) {
+        fprintf(stderr, "Error: --rate is not supported with --virtual-time\n");
+        exit(1);
+    }
+    if (stream_rate > 0 && NZ < 1) {
+        fprintf(stderr, "Error: --rate needs at least one customer slot\n");
+        exit(1);
+    }
+    if (stream_duration_ms < 0) stream_duration_ms = F;
+
+    // Clients of the socket are the customers, N_CUS of them at once
+    if (server_path != NULL && (virtual_time || stream_rate > 0 || fiber_workers > 0)) {
+        fprintf(stderr, "Error: --server is not supported with --virtual-time, --rate or --fibers\n");
+        exit(1);
+    }
+    if (server_path != NULL && NZ < 1) {
+        fprintf(stderr, "Error: --server needs at least one customer slot\n");
+        exit(1);
+    }
+
+    // The autoscaler adds officers above N_OFF up to M
+    if (max_officers == 0) max_officers = NU;
+    min_officers = NU;
+    if (max_officers < NU) {
+        fprintf(stderr, "Error: --max-officers must be at least N_OFF\n");
+        exit(1);
+    }
+    if (max_officers > NU && virtual_time) {
+        fprintf(stderr, "Error: --max-officers is not supported with --virtual-time\n");
+        exit(1);
+    }
+
+    // Officers pinned one to a CPU, customers on their own CPUs
+    if ((officer_cpu_list != NULL || customer_cpu_list != NULL || numa) && virtual_time) {
+        fprintf(stderr, "Error: --officer-cpus, --customer-cpus and --numa are not supported with --virtual-time\n");
+        exit(1);
+    }
+    cpu_set_t allowed_cpus;
+    sched_getaffinity(0, sizeof(allowed_cpus), &allowed_cpus);
+    if (placement_setup(officer_cpu_list, customer_cpu_list, numa) != 0) exit(1);
+    num_cpus = (int)sysconf(_SC_NPROCESSORS_CONF);
+    if (num_cpus < 1) num_cpus = 1;
+    if (num_cpus > CPU_SETSIZE) num_cpus = CPU_SETSIZE;
+
+    // The same seed draws the same numbers, a replay takes the seed of the record
+    if (!seed_given) run_seed = start_ns ^ ((uint64_t)getpid() << 32);
+    if (record_path != NULL && replay_path != NULL) {
+        fprintf(stderr, "Error: --record and --replay cannot be used together\n");
+        exit(1);
+    }
+    if ((record_path != NULL || replay_path != NULL) && virtual_time) {
+        fprintf(stderr, "Error: --virtual-time repeats a run with the same --seed, --record and --replay are not used\n");
+        exit(1);
+    }
+    if (replay_path != NULL && replay_load(replay_path) != 0) exit(1);
+    if (record_path != NULL && record_open(record_path) != 0) exit(1);
+
     // File handling
     FILE* f;
-    f = fopen("proj2.out", "w");
+    f = fopen(binary_log ? LOG_FILE_NAME : "proj2.out", "w");
     if (f == NULL) {
         fprintf(stderr, "Error: Nepodarilo sa otvorit subor\n");
         exit(1);
     }
 
+    // The buffer of the log writer, of stdio in the virtual time mode
+    char *log_buffer = malloc(log_buffer_size);
+    if (log_buffer == NULL) {
+        fprintf(stderr, "Error: Failed to allocate the log buffer\n");
+        exit(1);
+    }
+    if (virtual_time) setvbuf(f, log_buffer, _IOFBF, log_buffer_size);
+    log_start_ns = start_ns;
+    if (binary_log && (write_log_header(f) != 0 || fflush(f) == EOF)) {
+        fprintf(stderr, "Error: Failed to write the header of %s\n", LOG_FILE_NAME);
+        exit(1);
+    }
+
+    static Report report;
+    report.mode = virtual_time ? "virtual-time" : server_path != NULL ? "server" : fiber_workers > 0 ? "fibers" : threads_mode ? "threads" : "processes";
+    report.policy = scheduler->name;
+    report.services = service_types;
+    report.batch = batch_size;
+    report.NZ = NZ;
+    report.NU = NU;
+    report.TZ = TZ;
+    report.TU = TU;
+    report.F = F;
+    report.rate = stream_rate;
+    report.stable = true;
+    report.max_officers = max_officers;
+    report.officer_peak = NU;
+    report.seed = run_seed;
+    report.placement = placement;
+
+    if (virtual_time)
+    {
+        Histogram *wait_hist = calloc(2 * service_types, sizeof(Histogram));
+        OfficerStats *officers = aligned_calloc(NU, sizeof(OfficerStats));
+        if (wait_hist == NULL || officers == NULL) {
+            fprintf(stderr, "Error: Failed to allocate the histograms\n");
+            return 1;
+        }
+        Histogram *service_hist = wait_hist + service_types;
+
+        report.turned_away = virtual_time_simulation(NZ, NU, TZ, TU, F, f, wait_hist, service_hist, officers);
+        if (fclose(f) == EOF) {
+            fprintf(stderr, "Closing of the file failed\n");
+            return 1;
+        }
+        if (report.turned_away < 0) return 1;
+
+        report.wall_ns = now_ns() - start_ns;
+        report.officer_ns = report.wall_ns * NU;
+        int result = write_results(&report, report_path, hist_path, wait_hist, service_hist, officers);
+        free(log_buffer);
+        free(wait_hist);
+        free(officers);
+        return result;
+    }
+
     // _______SHARED MEMERY INICIALIZATION__________
 
-    int shmid = shmget(shared_memory_key, sizeof(Shared_memory), IPC_CREAT | 0666);
-    if(shmid < 0)
+    if (lock_profile_path != NULL && lock_profile_create() != 0)
     {
-        fprintf(stderr, "A error occured during the shared memory allocation - pointer allocation\n");
+        fprintf(stderr, "A error occured during the allocation of the lock profile\n");
         return 1;
     }
 
-    //attachment of the shared memory to the address space
-    Shared_memory *shm = shmat(shmid, NULL, 0);
-    if(shm == (Shared_memory*) -1)
+    size_t shm_size = shared_mem_layout(NULL, NZ, max_officers, service_types);
+    Shared_memory *shm = create_shared_mem(shm_size);
+    if (shm == NULL)
     {
         fprintf(stderr, "A error occured during the shared memory allocation - space allocation\n");
         return 1;
     }
 
+    // A page lands on the node of the CPU that touches it first,
+    // with --numa that of the officers, who use the memory the most
+    if (numa) {
+        pin_main(true, &allowed_cpus);
+        memset(shm, 0, shm_size);
+    }
+    if (numa || customers_pinned) pin_main(false, &allowed_cpus);
+
     // Inicialization of variables in the shared memory
-    shm -> open = true;
-    shm -> cislo_vypisu = 1;
-    shm -> num_letters = 0;
-    shm -> num_packages = 0;
-    shm -> num_money = 0;
+    atomic_init(&shm->log_head, 0);
+    atomic_init(&shm->log_stop, false);
+    atomic_init(&shm->log_abort, false);
+    atomic_init(&shm->log_flushed, false);
+    for (int i = 0; i < LOG_RING_SIZE; i++) {
+        atomic_init(&shm->log_ring[i].sequence, i);
+    }
+    atomic_init(&shm->waiting, 0);
+    atomic_init(&shm->started, 0);
+    atomic_init(&shm->last_start_ns, 0);
+    shared_mem_layout(shm, NZ, max_officers, service_types);
+    memset(shm->wait_hist, 0, 2 * service_types * sizeof(Histogram));
+
+    // Live statistics for proj2-stat
+    stats_remove_stale();
+    shm->stats = stats_create(NZ, max_officers, service_types, start_ns);
+    if (shm->stats == NULL)
+    {
+        fprintf(stderr, "A error occured during the allocation of the statistics\n");
+        return 1;
+    }
+    atomic_store(&shm->stats->active_officers, NU);
+    shm->officers = stats_officers(shm->stats);
+    shm->lane_stats = stats_lanes(shm->stats);
+
+    // The named statistics are the only thing a killed run could leave behind
+    int cleanup_signals[] = { SIGINT, SIGTERM, SIGHUP, SIGQUIT, SIGABRT, SIGSEGV, SIGBUS };
+    for (size_t i = 0; i < sizeof(cleanup_signals) / sizeof(cleanup_signals[0]); i++) {
+        signal(cleanup_signals[i], stats_signal_cleanup);
+    }
+    for (int i = 0; i < (service_types + 63) / 64; i++) {
+        atomic_init(&shm->queues.bitmap[i], 0);
+    }
+    for (int i = 0; i < service_types; i++) {
+        Lane *lane = &shm->queues.lanes[i];
+        lane->head = 0;
+        lane->tail = 0;
+        atomic_init(&lane->length, 0);
+        atomic_init(&lane->head_enter_ns, INT64_MAX);
+    }
 
     // _______SEMAPHORES INICIALIZATION__________
-    if (sem_inicialization(&shm->sem_writing, 1) == 1) return 1;
-    if (sem_inicialization(&shm->sem_post_office, 1) == 1) return 1;
-    if (sem_inicialization(&shm->sem_letters, 0) == 1) return 1;
-    if (sem_inicialization(&shm->sem_packages, 0) == 1) return 1;
-    if (sem_inicialization(&shm->sem_money, 0) == 1) return 1;
-    if (sem_inicialization(&shm->sem_uradnik, 1) == 1) return 1;
-    if (sem_inicialization(&shm->sem_calling_before_done, 0) == 1) return 1;
+    if (sem_inicialization(&shm->sem_work, 0) == 1) return 1;
+    if (sem_inicialization(&shm->sem_closed, 0) == 1) return 1;
+    for (int i = 0; i < service_types; i++) {
+        if (sem_inicialization(&shm->queues.lanes[i].sem_lane, 1) == 1) return 1;
+    }
+    for (int i = 0; i < NZ; i++) {
+        if (sem_inicialization(&shm->slots[i].sem_called, 0) == 1) return 1;
+        if (sem_inicialization(&shm->slots[i].sem_calling_before_done, 0) == 1) return 1;
+        shm->free_slots[i] = NZ - i;
+    }
+    shm->free_top = NZ;
+    if (sem_inicialization(&shm->sem_free, NZ) == 1) return 1;
+    if (sem_inicialization(&shm->sem_pool, 1) == 1) return 1;
+
+    // Log writer, started before any line can be produced
+    pthread_t writer_thread;
+    LogWriterArgs writer_args = { shm, f, log_buffer };
+    pid_t writer_pid = -1;
+    log_shm = shm;
+    atexit(log_final_flush);
+
+    if (threads_mode)
+    {
+        if (pthread_create(&writer_thread, NULL, log_writer_thread, &writer_args) != 0)
+        {
+            fprintf(stderr, "Failed to create the log writer thread\n");
+            exit(1);
+        }
+    }
+    else
+    {
+        pid_t parent = getpid();
+        writer_pid = fork();
+        if (writer_pid == -1)
+        {
+            fprintf(stderr, "Failed to create the log writer process\n");
+            exit(1);
+        }
+        else if (writer_pid == 0)
+        {
+            // The writer outlives the main process just to write its lines
+            die_with_parent(parent);
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            int writer_signals[] = { SIGINT, SIGTERM, SIGHUP, SIGQUIT };
+            for (size_t i = 0; i < sizeof(writer_signals) / sizeof(writer_signals[0]); i++) {
+                signal(writer_signals[i], log_writer_signal);
+            }
+            log_writer(shm, f, log_buffer);
+            exit(0);
+        }
+    }
 
     // Fork
     ProcessInfo process_info;
-    process_info.type = MAIN;
+    process_info_init(&process_info, MAIN, 0);
+
+    pthread_t *threads = NULL;
+    WorkerArgs *workers = NULL;
+    FiberWorker *fibers = NULL;
+    static Server server_state;
+    int children = 0;
+    StreamResult stream = { 0 };
+    Autoscaler autoscaler = { .min = NU, .max = max_officers, .active = NU, .peak = NU,
+                              .num_zakaznik = NZ, .TU = TU };
 
-    
-    if (process_info.type == MAIN) 
+    // Only the officers are started ahead in the streaming and server modes,
+    // the customer fibers are left to their workers
+    int started_customers = stream_rate > 0 || fiber_workers > 0 || server_path != NULL ? 0 : NZ;
+
+    int64_t spawn_ns = now_ns();
+    if (threads_mode)
+    {
+        // Officers started by the autoscaler follow the customers
+        threads = malloc((NZ + max_officers) * sizeof(pthread_t));
+        workers = malloc((NZ + max_officers) * sizeof(WorkerArgs));
+        autoscaler.thread_started = calloc(max_officers, sizeof(bool));
+        autoscaler.threads = threads;
+        autoscaler.workers = workers;
+        if (threads == NULL || workers == NULL || autoscaler.thread_started == NULL)
+        {
+            fprintf(stderr, "Error: Failed to allocate worker threads\n");
+            exit(1);
+        }
+        if (create_threads(started_customers, NU, TZ, TU, shm, workers, threads) == 1) exit(1);
+        if (fiber_workers > 0 && (fibers = fibers_start(NZ, TZ, shm)) == NULL) exit(1);
+        if (server_path != NULL && server_start(&server_state, server_path, NZ) != 0) exit(1);
+    }
+    else if (process_info.type == MAIN) 
     {
-        create_processes(NZ, NU, &process_info);
+        children = create_processes(started_customers, NU, &process_info, shm);
     } 
 
 
-    if (process_info.type == MAIN)
+    autoscaler.last_ns = now_ns();
+    if (process_info.type == MAIN && stream_rate > 0)
     {
-        int time = (random() % ((F/2) + 1)) + (F/2); 
-        usleep(time * 1000);
-
-        sem_wait(&shm->sem_writing);
+        // Customers of the threads follow the officers in workers
+        stream_generate(shm, &process_info, workers + NU, writer_pid, &autoscaler, &stream);
+    }
+    else if (process_info.type == MAIN && server_path != NULL)
+    {
+        server_run(&server_state, shm, &process_info, &autoscaler);
+    }
+    else if (process_info.type == MAIN)
+    {
+        int time = decision(&process_info, DECISION_CLOSE, rng_below(&process_info.rng, (F/2) + 1) + (F/2));
+        autoscale_open(&autoscaler, shm, &process_info, time);
+    }
 
-        shm->open = false;
+    if (process_info.type == MAIN)
+    {
 
-        fprintf(f, "%d: closing\n", shm->cislo_vypisu);
-        shm->cislo_vypisu++;
-        fflush(f);
+        write_log_closing(shm);
+        atomic_store(&shm->stats->closed, true);
+        decisions_flush(&process_info);
 
-        sem_post(&shm->sem_writing);
+        // Wakes up all officers at work at once, each goes home with one token
+        // the customers waiting to arrive and officers on break at the latch
+        for (int i = 0; i < autoscaler.active; i++) {
+            lock_post(LOCK_WORK, &shm->sem_work);
+        }
+        lock_post(LOCK_CLOSED, &shm->sem_closed);
+        if (fibers != NULL) fibers_close(fibers);
+        if (server_path != NULL) server_drain(&server_state, shm);
     }
 
 
@@ -638,37 +4769,122 @@ int main(int argc,char *argv[])
     switch(process_info.type)
 	{
 		case ZAKAZNIK:  
-            customer(&process_info,TZ, shm, f);
+            if (stream_rate > 0) {
+                customer(&process_info, 0, shm);
+                slot_release(shm, process_info.slot);
+                exit(0);
+            }
+            customer(&process_info,TZ, shm);
+            // Waiting for the processes spawned by this one
+            while (wait(NULL) > 0);
             exit(0);
 			break;
 		case URADNIK:   
-            urad(&process_info, TU, shm, f);
+            urad(&process_info, TU, shm);
+            while (wait(NULL) > 0);
             exit(0);
 			break;
 		default:
 			break;
 	}
 
-    // Main process waiting for all child processes
-    while (wait(NULL) != -1);
+    // Main process waiting for all child processes or threads
+    if (threads_mode)
+    {
+        for (int i = 0; i < started_customers + NU; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        for (int i = NU; i < max_officers; i++) {
+            if (autoscaler.thread_started[i]) pthread_join(threads[NZ + i], NULL);
+        }
+        free(autoscaler.thread_started);
+        if (fibers != NULL) fibers_join(fibers, NZ);
+        // Customers of the stream are detached, the workers and the shared
+        // memory are freed only after each counted itself done
+        while (atomic_load(&stream_threads_done) < stream.threads) {
+            usleep(LOG_WRITER_IDLE_US);
+        }
+        free(threads);
+        free(workers);
+
+        atomic_store(&shm->log_stop, true);
+        pthread_join(writer_thread, NULL);
+    }
+    else
+    {
+        // Every child waits for its own subtree of the spawn tree
+        // and the officers and customers main started later and did not reap yet
+        int remaining = children + autoscaler.forked + stream.forked - stream.reaped;
+        while (remaining > 0)
+        {
+            pid_t pid = wait(NULL);
+            if (pid == -1) break;
+            if (pid == writer_pid)
+            {
+                fprintf(stderr, "Error: The log writer exited early\n");
+                writer_pid = -1;
+                continue;
+            }
+            remaining--;
+        }
+
+        atomic_store(&shm->log_stop, true);
+        if (writer_pid != -1) waitpid(writer_pid, NULL, 0);
+    }
+    log_shm = NULL;
+    free(log_buffer);
 
     setbuf(f, NULL);
+    if (server_path != NULL) {
+        stream.arrivals = server_state.connections;
+        stream.rejected = server_state.rejected;
+        server_stop(&server_state, shm, NZ);
+    }
+
+    report.wall_ns = now_ns() - start_ns;
+    report.turned_away = atomic_load(&shm->stats->turned_away);
+    if (atomic_load(&shm->started) > 0) report.startup_ns = atomic_load(&shm->last_start_ns) - spawn_ns;
+    autoscale_account(&autoscaler, now_ns());
+    report.officer_ns = autoscaler.officer_ns;
+    report.officer_peak = autoscaler.peak;
+    report.arrivals = stream.arrivals;
+    report.rejected = stream.rejected;
+    report.queue_growth_per_s = stream.growth_per_s;
+    if (stream_rate > 0) report.stable = stream.stable;
+    report_cpus(&report, shm->cpu_served);
+    report.log_writes = shm->log_writes;
+    report.log_sleeps = shm->log_sleeps;
+    int result = write_results(&report, report_path, hist_path, shm->wait_hist, shm->service_hist, shm->officers);
+    free(report.cpu_served);
+    if (lock_profile_path != NULL && write_lock_profile(lock_profile_path) != 0) result = 1;
+    if (record_fd != -1 && close(record_fd) == -1) {
+        fprintf(stderr, "Error: Failed to write the record file %s\n", record_path);
+        result = 1;
+    }
+    if (replay != NULL) {
+        fprintf(stderr, "Replayed %s, %" PRIu64 " decisions diverged\n", replay_path, atomic_load(&replay->divergences));
+    }
 
     // Destruction of semaphores
-    sem_destroy(&shm->sem_writing);
-    sem_destroy(&shm->sem_post_office);
-    sem_destroy(&shm->sem_letters);
-    sem_destroy(&shm->sem_packages);
-    sem_destroy(&shm->sem_money);
-    sem_destroy(&shm->sem_uradnik);
-    sem_destroy(&shm->sem_calling_before_done);
+    sem_destroy(&shm->sem_work);
+    sem_destroy(&shm->sem_free);
+    sem_destroy(&shm->sem_pool);
+    sem_destroy(&shm->sem_closed);
+    for (int i = 0; i < service_types; i++) {
+        sem_destroy(&shm->queues.lanes[i].sem_lane);
+    }
+    for (int i = 0; i < NZ; i++) {
+        sem_destroy(&shm->slots[i].sem_called);
+        sem_destroy(&shm->slots[i].sem_calling_before_done);
+    }
 
 
     //Cleanup of shared memory
     if (fclose(f) == EOF) {
         fprintf(stderr, "Closing of the file failed\n");
     }
-    destroy_shared_mem(shmid, shm);
+    stats_destroy(shm->stats);
+    destroy_shared_mem(shm, shm_size);
 
-    return 0;
-}
\ No newline at end of file
+    return result;
+}
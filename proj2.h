@@ -0,0 +1,216 @@
+/**************************/
+/* *  Daniel Sehnoutek  * */
+/* *        IOS2        * */
+/**************************/
+
+/*
+ *  Live statistics of a running proj2 shared with proj2-stat
+ *  through POSIX shared memory /proj2-stats.<pid>, the
+ *  log lines shared with proj2-dump through the binary log
+ *  and the protocol of the server mode used by proj2-load
+ */
+
+#ifndef PROJ2_H
+#define PROJ2_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+
+// Size of a cache line, data written by different workers is kept on different lines
+#define CACHE_LINE 64
+
+// Name of the statistics of the process with the pid
+#define STATS_NAME_FORMAT "/proj2-stats.%d"
+#define STATS_NAME_MAX 32
+
+// "PROJ2ST" in memory and the layout version, a reader checks both
+#define STATS_MAGIC UINT64_C(0x005453324A4F5250)
+#define STATS_VERSION 2
+
+typedef enum {
+    OFFICER_STARTING,
+    OFFICER_IDLE,
+    OFFICER_SERVING,
+    OFFICER_BREAK,
+    OFFICER_HOME
+} OfficerState;
+
+/*
+ *  Structure: OfficerStats
+ *  -----------------------
+ *  Statistics of one officer, written only by the officer
+ *  on a cache line of its own
+ */
+typedef struct {
+    _Alignas(CACHE_LINE) _Atomic uint64_t served;
+    _Atomic uint64_t breaks;
+    _Atomic int state;
+} OfficerStats;
+
+/*
+ *  Structure: LaneStats
+ *  --------------------
+ *  Length of the queue of one service,
+ *  written under the lock of the queue
+ */
+typedef struct {
+    _Alignas(CACHE_LINE) _Atomic int length;
+} LaneStats;
+
+/*
+ *  Structure: StatsBlock
+ *  ---------------------
+ *  Header of the statistics, num_officers OfficerStats (all the autoscaler
+ *  may start) and num_services LaneStats follow at the offsets
+ *  magic is written last, readers only read
+ */
+typedef struct {
+    _Atomic uint64_t magic;
+    uint32_t version;
+    int32_t pid;
+    uint64_t size;
+    int32_t num_customers;
+    int32_t num_officers;
+    int32_t num_services;
+    // CLOCK_MONOTONIC time of the start of the run
+    int64_t start_ns;
+    uint64_t officers_offset;
+    uint64_t lanes_offset;
+    _Atomic bool closed;
+    _Atomic bool finished;
+    // Officers at work, written by the autoscaler
+    _Atomic int active_officers;
+    _Alignas(CACHE_LINE) _Atomic int turned_away;
+    _Alignas(CACHE_LINE) _Atomic int customers_done;
+    // Lines written to proj2.out, only the log writer writes it
+    _Alignas(CACHE_LINE) _Atomic uint64_t log_lines;
+} StatsBlock;
+
+/*
+ *  Function: stats_officers
+ *  ------------------------
+ *  Returns: statistics of the officers of the block
+ */
+static inline OfficerStats *stats_officers(StatsBlock *stats)
+{
+    return (OfficerStats *)((char *)stats + stats->officers_offset);
+}
+
+/*
+ *  Function: stats_lanes
+ *  ---------------------
+ *  Returns: queue lengths of the block
+ */
+static inline LaneStats *stats_lanes(StatsBlock *stats)
+{
+    return (LaneStats *)((char *)stats + stats->lanes_offset);
+}
+
+typedef enum {
+    MAIN,
+    ZAKAZNIK,
+    URADNIK
+} ProcessType;
+
+typedef enum {
+    LOG_STARTED,
+    LOG_GOING_HOME,
+    LOG_ENTERING,
+    LOG_CALLED,
+    LOG_SERVING,
+    LOG_SERVICE_FINISHED,
+    LOG_TAKING_BREAK,
+    LOG_BREAK_FINISHED,
+    LOG_CLOSING,
+    LOG_SCALE_UP,
+    LOG_SCALE_DOWN
+} LogEvent;
+
+// Maximal length of a formatted log line
+#define LOG_LINE_MAX 64
+
+// Name of the binary log (--binary-log), "PROJ2LOG" and the version of the records
+#define LOG_FILE_NAME "proj2.bin"
+#define LOG_FILE_MAGIC "PROJ2LOG"
+#define LOG_FILE_VERSION 1
+
+/*
+ *  Structure: LogFileHeader
+ *  ------------------------
+ *  Start of the binary log, the records follow
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+} LogFileHeader;
+
+/*
+ *  Structure: LogFileRecord
+ *  ------------------------
+ *  One line of the binary log, seq is the line number and
+ *  time_ns the time since the start of the run it was logged
+ *  (simulated time in the virtual time mode)
+ */
+typedef struct {
+    uint64_t seq;
+    int64_t time_ns;
+    uint32_t id;
+    uint16_t service;
+    uint8_t type;
+    uint8_t event;
+} LogFileRecord;
+
+/*
+ *  Function: log_format_line
+ *  -------------------------
+ *  Formats one log line in the proj2.out format,
+ *  buf has room for LOG_LINE_MAX characters
+ *  Returns: length of the line
+ */
+static inline int log_format_line(char *buf, uint64_t number, int type, int id, int event, int service)
+{
+    static const char *states[] = {
+        [LOG_STARTED] = "started",
+        [LOG_GOING_HOME] = "going home",
+        [LOG_ENTERING] = "entering office for a service",
+        [LOG_CALLED] = "called by office worker",
+        [LOG_SERVING] = "serving a service of type",
+        [LOG_SERVICE_FINISHED] = "service finished",
+        [LOG_TAKING_BREAK] = "taking break",
+        [LOG_BREAK_FINISHED] = "break finished",
+    };
+
+    if (event == LOG_CLOSING) {
+        return snprintf(buf, LOG_LINE_MAX, "%" PRIu64 ": closing\n", number);
+    }
+    if (event == LOG_SCALE_UP || event == LOG_SCALE_DOWN) {
+        return snprintf(buf, LOG_LINE_MAX, "%" PRIu64 ": scaling %s to %d officers\n", number,
+                        event == LOG_SCALE_UP ? "up" : "down", service);
+    }
+
+    const char *name = type == ZAKAZNIK ? "Z" : "U";
+    if (event == LOG_ENTERING || event == LOG_SERVING) {
+        return snprintf(buf, LOG_LINE_MAX, "%" PRIu64 ": %s %d: %s %d\n", number, name, id, states[event], service);
+    }
+    return snprintf(buf, LOG_LINE_MAX, "%" PRIu64 ": %s %d: %s\n", number, name, id, states[event]);
+}
+
+/*
+ *  Protocol of the server mode (--server=PATH), one customer per connection
+ *  to the UNIX socket: the client sends "ENTER <service>\n" (0 for a random
+ *  service), the server answers "CALLED\n" when an officer calls the customer,
+ *  "CLOSED\n" if the post is closed, "BUSY\n" if all N_CUS slots are taken
+ *  or "ERROR\n", and closes the connection
+ */
+#define SERVER_ENTER "ENTER"
+#define SERVER_CALLED "CALLED\n"
+#define SERVER_CLOSED "CLOSED\n"
+#define SERVER_BUSY "BUSY\n"
+#define SERVER_ERROR "ERROR\n"
+#define SERVER_LINE_MAX 32
+
+#endif